@@ -3,18 +3,68 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "ThreadPool.h"
 
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
 
 class bvh_node : public hittable
 {
 public:
-    bvh_node(const hittable_list &list) : bvh_node(list.objects, 0, list.objects.size()) {}
+    // The list is taken by value, the recursion then sorts that single copy in place
+    bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size()) {}
 
-    bvh_node(const vector<shared_ptr<hittable>> &src_objects, size_t start, size_t end)
+    bool hit(const ray &r, interval ray_t, hit_info &hit) const override
+    {
+        if (!intersect(r, ray_t, hit))
+            return false;
+
+        complete(r, hit);
+        return true;
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_info &hit) const override
+    {
+        if (!bbox.hit(r, ray_t))
+            return false;
+
+        // when loop into leaf node, right/left should be primitive
+        bool hit_l = left->intersect(r, ray_t, hit);
+        if (left == right)
+            return hit_l;
+
+        bool hit_r = right->intersect(r, interval(ray_t.min, /*if left hit, then check any hit before left hit*/ hit_l ? hit.t : ray_t.max), hit);
+
+        return hit_l || hit_r;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        if (!bbox.hit(r, ray_t))
+            return false;
+
+        if (left->occluded(r, ray_t))
+            return true;
+
+        return left != right && right->occluded(r, ray_t);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+private:
+    shared_ptr<hittable> left;
+    shared_ptr<hittable> right;
+    aabb bbox;
+
+    // Sorts objects[start, end) in place, only reachable through the by-value constructor so callers keep their order
+    bvh_node(vector<shared_ptr<hittable>> &objects, size_t start, size_t end)
     // original method
     {
-        auto objects = src_objects;
 
         int axis = random_int(0, 2);
         auto comparator = (axis == 0)   ? box_x_compare
@@ -49,32 +99,14 @@ public:
             // but std::sort() is still slightly faster than our method :(
             // kth_partition(objects, axis, start, end - 1, mid);
 
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+            // A single object is used directly, wrapping it into a node would intersect it twice
+            left = (mid - start == 1) ? objects[start] : shared_ptr<bvh_node>(new bvh_node(objects, start, mid));
+            right = shared_ptr<bvh_node>(new bvh_node(objects, mid, end));
         }
 
         bbox = aabb(left->bounding_box(), right->bounding_box());
     }
 
-    bool hit(const ray &r, interval ray_t, hit_info &hit) const override
-    {
-        if (!bbox.hit(r, ray_t))
-            return false;
-
-        // when loop into leaf node, right/left should be primitive
-        bool hit_l = left->hit(r, ray_t, hit);
-        bool hit_r = right->hit(r, interval(ray_t.min, /*if left hit, then check any hit before left hit*/ hit_l ? hit.t : ray_t.max), hit);
-
-        return hit_l || hit_r;
-    }
-
-    aabb bounding_box() const override { return bbox; }
-
-private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb bbox;
-
     static bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index)
     {
         return a->bounding_box().axis(axis_index).min < b->bounding_box().axis(axis_index).min;
@@ -119,4 +151,710 @@ private:
         if (i < k)
             kth_partition(objects, axis, i + 1, end, k);
     }
-};
\ No newline at end of file
+};
+
+// Round outwards so the float box always contains the double one
+inline float round_down(double v)
+{
+    float f = static_cast<float>(v);
+    return (static_cast<double>(f) > v) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up(double v)
+{
+    float f = static_cast<float>(v);
+    return (static_cast<double>(f) < v) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Bound on the relative error of n float roundings (gamma(n) in PBRT)
+constexpr double float_gamma(int n)
+{
+    constexpr double half_eps = std::numeric_limits<float>::epsilon() * 0.5;
+    return (n * half_eps) / (1 - n * half_eps);
+}
+
+// A float slab distance is off by three roundings (difference, inverse direction, product) in either direction
+// Scaling the exit distance by this before the compare keeps every box the exact test hits, rounding up covers the scaling itself
+inline const float slab_exit_scale = round_up(1.0 + 2.0 * float_gamma(3));
+
+// Compact BVH node, 32 bytes so two of them share a cache line
+// Interior nodes keep their first child right after themselves (depth-first order) and the index of the second child in offset
+// Leaf nodes keep [offset, offset + primitive_count) as indices into flat_bvh::primitives
+struct alignas(32) flat_bvh_node
+{
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset;
+    uint16_t primitive_count; // 0 for interior nodes
+    uint8_t axis;             // Split axis of interior nodes, used for front-to-back traversal
+    uint8_t padding;
+
+    static constexpr uint32_t max_primitive_count = std::numeric_limits<uint16_t>::max(); // Largest leaf primitive_count can hold
+
+    bool is_leaf() const { return primitive_count > 0; }
+};
+
+static_assert(sizeof(flat_bvh_node) == 32, "flat_bvh_node should stay 32 bytes");
+
+// Construction strategy of flat_bvh
+enum class bvh_build_method
+{
+    sah, // Binned surface area heuristic, best traversal performance
+    lbvh // Split along a Morton curve of the centroids, near-linear build for previews and animation frames
+};
+
+// BVH linearized into a single contiguous node array, traversed iteratively with a small stack
+// Built top-down, leaves hold up to max_leaf_size primitives
+class flat_bvh : public hittable
+{
+public:
+    flat_bvh(const hittable_list &list, int _max_leaf_size = 4) : method(bvh_build_method::sah), max_leaf_size(clamp_leaf_size(_max_leaf_size))
+    {
+        vector<build_primitive> build_prims = begin_build(list);
+        if (build_prims.empty())
+            return;
+
+        nodes.reserve(2 * build_prims.size());
+        build_recursive(nodes, build_prims, 0, build_prims.size(), 0);
+        finish_build(build_prims);
+    }
+
+    // Parallel build: every split of the top levels hands one half to a task on pool, the subtrees below grain are built serially
+    flat_bvh(const hittable_list &list, ThreadPool &pool, bvh_build_method _method = bvh_build_method::sah, int _max_leaf_size = 4)
+        : method(_method), max_leaf_size(clamp_leaf_size(_max_leaf_size))
+    {
+        vector<build_primitive> build_prims = begin_build(list);
+        if (build_prims.empty())
+            return;
+
+        if (method == bvh_build_method::lbvh)
+            sort_by_morton(pool, build_prims);
+
+        size_t grain = std::max(min_parallel_span, build_prims.size() / (subtrees_per_worker * pool.Size()));
+
+        top_node top;
+        build_top(pool, top, build_prims, 0, build_prims.size(), 0, grain);
+
+        nodes.reserve(count_nodes(top));
+        emit_top(top);
+        finish_build(build_prims);
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_info &hit) const override
+    {
+        if (!intersect(r, ray_t, hit))
+            return false;
+
+        complete(r, hit);
+        return true;
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_info &hit) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        ray_slabs slabs(r, ray_t);
+
+        bool hit_any = false;
+        uint32_t stack[max_stack_depth];
+        int stack_size = 0;
+        uint32_t current = 0;
+
+        while (true)
+        {
+            const flat_bvh_node &node = nodes[current];
+
+            if (slabs.hit(node))
+            {
+                if (node.is_leaf())
+                {
+                    for (uint32_t i = node.offset; i < node.offset + node.primitive_count; ++i)
+                    {
+                        if (primitive_ptrs[i]->intersect(r, ray_t, hit))
+                        {
+                            hit_any = true;
+                            ray_t.max = hit.t;
+                            slabs.t_max = round_up(hit.t);
+                        }
+                    }
+
+                    if (stack_size == 0)
+                        break;
+                    current = stack[--stack_size];
+                }
+                else
+                {
+                    // Visit the near child first, the far one waits on the stack
+                    if (r.sign(node.axis))
+                    {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    }
+                    else
+                    {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                }
+            }
+            else
+            {
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+        }
+
+        return hit_any;
+    }
+
+    // Stops at the first primitive found in ray_t, so the visiting order does not matter
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        ray_slabs slabs(r, ray_t);
+
+        uint32_t stack[max_stack_depth];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0)
+        {
+            uint32_t current = stack[--stack_size];
+            const flat_bvh_node &node = nodes[current];
+
+            if (!slabs.hit(node))
+                continue;
+
+            if (node.is_leaf())
+            {
+                for (uint32_t i = node.offset; i < node.offset + node.primitive_count; ++i)
+                {
+                    if (primitive_ptrs[i]->occluded(r, ray_t))
+                        return true;
+                }
+            }
+            else
+            {
+                stack[stack_size++] = node.offset;
+                stack[stack_size++] = current + 1;
+            }
+        }
+
+        return false;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); }
+
+    // Read-only access for structures derived from this one (e.g. wide_bvh)
+    const vector<flat_bvh_node> &node_array() const { return nodes; }
+    const vector<shared_ptr<hittable>> &primitive_array() const { return primitives; }
+
+private:
+    static constexpr int max_stack_depth = 64;
+    static constexpr int max_split_depth = 32;
+    static constexpr int sah_bins = 16;
+    static constexpr double sah_traversal_cost = 0.125; // Relative to the cost of a primitive intersection
+    static constexpr size_t min_parallel_span = 1024;   // Smallest subtree worth a task of its own
+    static constexpr size_t subtrees_per_worker = 4;
+    static constexpr size_t morton_30bit_limit = 1 << 18; // Up to this many primitives 10 bits per axis are enough
+
+    struct build_primitive
+    {
+        aabb bbox;
+        point3 centroid;
+        uint32_t index;
+        uint64_t morton; // Only used by the LBVH builder
+    };
+
+    struct morton_key
+    {
+        uint64_t code;
+        uint32_t index; // Into build_prims
+    };
+
+    // Node of the top levels of a parallel build, either an interior node or the root of a subtree built by one task
+    struct top_node
+    {
+        int axis = 0;
+        std::unique_ptr<top_node> children[2];
+        vector<flat_bvh_node> subtree; // Depth-first, offsets relative to the subtree root
+    };
+
+    vector<shared_ptr<hittable>> primitives; // Owning, ordered by leaf
+    vector<const hittable *> primitive_ptrs; // Same order, used for traversal to skip the refcounted pointers
+    vector<flat_bvh_node> nodes;
+    aabb bbox;
+    bvh_build_method method;
+    int max_leaf_size;
+
+    static int clamp_leaf_size(int leaf_size)
+    {
+        return std::clamp(leaf_size, 1, static_cast<int>(flat_bvh_node::max_primitive_count));
+    }
+
+    static point3 centroid(const aabb &box)
+    {
+        return point3(0.5 * (box.x.min + box.x.max), 0.5 * (box.y.min + box.y.max), 0.5 * (box.z.min + box.z.max));
+    }
+
+    static void set_bounds(flat_bvh_node &node, const aabb &box)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            node.bounds_min[a] = round_down(box.axis(a).min);
+            node.bounds_max[a] = round_up(box.axis(a).max);
+        }
+    }
+
+    static void merge_bounds(flat_bvh_node &node, const flat_bvh_node &a, const flat_bvh_node &b)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            node.bounds_min[i] = std::min(a.bounds_min[i], b.bounds_min[i]);
+            node.bounds_max[i] = std::max(a.bounds_max[i], b.bounds_max[i]);
+        }
+    }
+
+    // Single precision copy of the ray for the node slab tests
+    // The origin is rounded towards each plane so that its slab can only grow, t_min is rounded down like t_max is rounded up
+    struct ray_slabs
+    {
+        float origin_near[3];
+        float origin_far[3];
+        float inv_dir[3];
+        int sign[3];
+        float t_min, t_max;
+
+        ray_slabs(const ray &r, const interval &ray_t) : t_min(round_down(ray_t.min)), t_max(round_up(ray_t.max))
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                sign[a] = r.sign(a);
+                origin_near[a] = sign[a] ? round_down(r.origin()[a]) : round_up(r.origin()[a]);
+                origin_far[a] = sign[a] ? round_up(r.origin()[a]) : round_down(r.origin()[a]);
+                inv_dir[a] = static_cast<float>(r.inv_direction()[a]);
+            }
+        }
+
+        // The sign picks the near and far planes, so no swapping is needed
+        bool hit(const flat_bvh_node &node) const
+        {
+            float t_enter = t_min;
+            float t_exit = t_max;
+
+            for (int a = 0; a < 3; ++a)
+            {
+                float t0 = ((sign[a] ? node.bounds_max[a] : node.bounds_min[a]) - origin_near[a]) * inv_dir[a];
+                float t1 = ((sign[a] ? node.bounds_min[a] : node.bounds_max[a]) - origin_far[a]) * inv_dir[a];
+
+                t_enter = t0 > t_enter ? t0 : t_enter;
+                t_exit = t1 < t_exit ? t1 : t_exit;
+            }
+            return t_enter <= t_exit * slab_exit_scale;
+        }
+    };
+
+    struct sah_split
+    {
+        int axis = -1; // -1 if no split beats the others
+        int bin = 0;   // Primitives in bins [0, bin] go to the first child
+        double cost = infinity;
+    };
+
+    struct sah_bin
+    {
+        aabb bounds;
+        size_t count = 0;
+    };
+
+    static int bin_index(const build_primitive &prim, int axis, const aabb &centroid_bounds)
+    {
+        const interval &extent = centroid_bounds.axis(axis);
+        int b = static_cast<int>(sah_bins * (prim.centroid[axis] - extent.min) / extent.size());
+        return b < 0 ? 0 : (b >= sah_bins ? sah_bins - 1 : b);
+    }
+
+    // Bin centroids along all three axes and return the cheapest split plane by the surface area heuristic
+    static sah_split find_sah_split(const vector<build_primitive> &build_prims, size_t start, size_t end, const aabb &bounds, const aabb &centroid_bounds)
+    {
+        sah_split best;
+        double inv_area = 1.0 / bounds.surface_area();
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (centroid_bounds.axis(axis).size() <= 0)
+                continue;
+
+            sah_bin bins[sah_bins];
+            for (size_t i = start; i < end; ++i)
+            {
+                sah_bin &b = bins[bin_index(build_prims[i], axis, centroid_bounds)];
+                b.bounds = aabb(b.bounds, build_prims[i].bbox);
+                ++b.count;
+            }
+
+            // Sweep from the right to get the cost contribution of every right-hand side
+            double right_cost[sah_bins - 1];
+            aabb right_bounds;
+            size_t right_count = 0;
+            for (int b = sah_bins - 1; b > 0; --b)
+            {
+                right_bounds = aabb(right_bounds, bins[b].bounds);
+                right_count += bins[b].count;
+                right_cost[b - 1] = right_count * right_bounds.surface_area();
+            }
+
+            // Then from the left, combining both sides
+            aabb left_bounds;
+            size_t left_count = 0;
+            for (int b = 0; b < sah_bins - 1; ++b)
+            {
+                left_bounds = aabb(left_bounds, bins[b].bounds);
+                left_count += bins[b].count;
+
+                if (left_count == 0 || left_count == end - start)
+                    continue;
+
+                double cost = sah_traversal_cost + (left_count * left_bounds.surface_area() + right_cost[b]) * inv_area;
+                if (cost < best.cost)
+                {
+                    best.axis = axis;
+                    best.bin = b;
+                    best.cost = cost;
+                }
+            }
+        }
+
+        return best;
+    }
+
+    vector<build_primitive> begin_build(const hittable_list &list)
+    {
+        primitives = list.objects;
+
+        vector<build_primitive> build_prims(primitives.size());
+        for (size_t i = 0; i < primitives.size(); ++i)
+        {
+            build_prims[i].bbox = primitives[i]->bounding_box();
+            build_prims[i].centroid = centroid(build_prims[i].bbox);
+            build_prims[i].index = static_cast<uint32_t>(i);
+        }
+
+        return build_prims;
+    }
+
+    void finish_build(const vector<build_primitive> &build_prims)
+    {
+        // Reorder primitives so that every leaf addresses a contiguous span
+        vector<shared_ptr<hittable>> ordered(primitives.size());
+        for (size_t i = 0; i < build_prims.size(); ++i)
+            ordered[i] = primitives[build_prims[i].index];
+        primitives = std::move(ordered);
+
+        primitive_ptrs.resize(primitives.size());
+        for (size_t i = 0; i < primitives.size(); ++i)
+            primitive_ptrs[i] = primitives[i].get();
+
+        nodes.shrink_to_fit();
+        bbox = aabb(interval(nodes[0].bounds_min[0], nodes[0].bounds_max[0]),
+                    interval(nodes[0].bounds_min[1], nodes[0].bounds_max[1]),
+                    interval(nodes[0].bounds_min[2], nodes[0].bounds_max[2]));
+    }
+
+    static void compute_bounds(const vector<build_primitive> &build_prims, size_t start, size_t end, aabb &bounds, aabb &centroid_bounds)
+    {
+        for (size_t i = start; i < end; ++i)
+        {
+            bounds = aabb(bounds, build_prims[i].bbox);
+            centroid_bounds = aabb(centroid_bounds, aabb(build_prims[i].centroid, build_prims[i].centroid));
+        }
+    }
+
+    // Choose the split of build_prims[start, end) and partition the span in place
+    // Returns the first index of the second child, or end if the span should stay a leaf
+    size_t split_range(vector<build_primitive> &build_prims, size_t start, size_t end, int depth, const aabb &bounds, const aabb &centroid_bounds, int &axis) const
+    {
+        size_t span = end - start;
+        if (span == 1)
+            return end;
+
+        if (method == bvh_build_method::lbvh)
+            return split_morton(build_prims, start, end, depth, axis);
+
+        // Widest centroid axis, used by the median fallback
+        axis = 0;
+        for (int a = 1; a < 3; ++a)
+            if (centroid_bounds.axis(a).size() > centroid_bounds.axis(axis).size())
+                axis = a;
+
+        size_t mid = start;
+
+        // Past max_split_depth only median splits are used, which keeps the traversal stack bounded
+        if (depth < max_split_depth)
+        {
+            sah_split split = find_sah_split(build_prims, start, end, bounds, centroid_bounds);
+
+            // Keep the primitives together if intersecting all of them is cheaper than any split
+            if (span <= static_cast<size_t>(max_leaf_size) && static_cast<double>(span) <= split.cost)
+                return end;
+
+            if (split.axis >= 0)
+            {
+                axis = split.axis;
+                auto it = std::partition(build_prims.begin() + start, build_prims.begin() + end,
+                                         [&](const build_primitive &p)
+                                         { return bin_index(p, split.axis, centroid_bounds) <= split.bin; });
+                mid = it - build_prims.begin();
+            }
+        }
+        else if (span <= static_cast<size_t>(max_leaf_size))
+        {
+            return end;
+        }
+
+        // No usable SAH split (e.g. all centroids coincide), cut at the median instead
+        if (mid == start || mid == end)
+            mid = median_split(build_prims, start, end, axis);
+
+        return mid;
+    }
+
+    // Cut build_prims[start, end) at its middle, ordered along axis (the Morton order already is)
+    size_t median_split(vector<build_primitive> &build_prims, size_t start, size_t end, int axis) const
+    {
+        size_t mid = start + (end - start) / 2;
+        if (method == bvh_build_method::sah)
+        {
+            std::nth_element(build_prims.begin() + start, build_prims.begin() + mid, build_prims.begin() + end,
+                             [axis](const build_primitive &a, const build_primitive &b)
+                             { return a.centroid[axis] < b.centroid[axis]; });
+        }
+        return mid;
+    }
+
+    // Emit the subtree over build_prims[start, end) into out in depth-first order, offsets are indices into out
+    void build_recursive(vector<flat_bvh_node> &out, vector<build_primitive> &build_prims, size_t start, size_t end, int depth) const
+    {
+        uint32_t node_index = static_cast<uint32_t>(out.size());
+        out.emplace_back();
+
+        // The Morton split needs no bounds, interior nodes get theirs from their children
+        aabb bounds, centroid_bounds;
+        if (method == bvh_build_method::sah || end - start <= static_cast<size_t>(max_leaf_size))
+            compute_bounds(build_prims, start, end, bounds, centroid_bounds);
+
+        int axis = 0;
+        size_t mid = split_range(build_prims, start, end, depth, bounds, centroid_bounds, axis);
+
+        // primitive_count is 16 bits, a span too large for it is split whatever the split choice was
+        if (mid == end && end - start > flat_bvh_node::max_primitive_count)
+            mid = median_split(build_prims, start, end, axis);
+
+        if (mid == end)
+        {
+            set_bounds(out[node_index], bounds);
+            out[node_index].offset = static_cast<uint32_t>(start);
+            out[node_index].primitive_count = static_cast<uint16_t>(end - start);
+            return;
+        }
+
+        build_recursive(out, build_prims, start, mid, depth + 1);
+        uint32_t second_child = static_cast<uint32_t>(out.size());
+        build_recursive(out, build_prims, mid, end, depth + 1);
+
+        merge_bounds(out[node_index], out[node_index + 1], out[second_child]);
+        out[node_index].offset = second_child;
+        out[node_index].primitive_count = 0;
+        out[node_index].axis = static_cast<uint8_t>(axis);
+    }
+
+    // Split the top levels until spans drop to grain, the second half of every split is built by a task of its own
+    // Waiting on the group runs other pool tasks, so the nested builds keep every worker busy
+    void build_top(ThreadPool &pool, top_node &node, vector<build_primitive> &build_prims, size_t start, size_t end, int depth, size_t grain) const
+    {
+        if (end - start > grain)
+        {
+            aabb bounds, centroid_bounds;
+            if (method == bvh_build_method::sah)
+                compute_bounds(build_prims, start, end, bounds, centroid_bounds);
+
+            int axis = 0;
+            size_t mid = split_range(build_prims, start, end, depth, bounds, centroid_bounds, axis);
+            if (mid != end)
+            {
+                node.axis = axis;
+                node.children[0] = std::make_unique<top_node>();
+                node.children[1] = std::make_unique<top_node>();
+
+                // The halves own disjoint spans of build_prims, so they can partition them in place concurrently
+                TaskGroup group(pool);
+                group.Run([this, &pool, &node, &build_prims, mid, end, depth, grain]
+                          { build_top(pool, *node.children[1], build_prims, mid, end, depth + 1, grain); });
+                build_top(pool, *node.children[0], build_prims, start, mid, depth + 1, grain);
+                group.Wait();
+                return;
+            }
+        }
+
+        node.subtree.reserve(2 * (end - start));
+        build_recursive(node.subtree, build_prims, start, end, depth);
+    }
+
+    static size_t count_nodes(const top_node &t)
+    {
+        if (!t.children[0])
+            return t.subtree.size();
+        return 1 + count_nodes(*t.children[0]) + count_nodes(*t.children[1]);
+    }
+
+    // Lay the top levels and the finished subtrees out in depth-first order
+    void emit_top(const top_node &t)
+    {
+        if (!t.children[0])
+        {
+            uint32_t base = static_cast<uint32_t>(nodes.size());
+            for (flat_bvh_node node : t.subtree)
+            {
+                if (!node.is_leaf())
+                    node.offset += base;
+                nodes.push_back(node);
+            }
+            return;
+        }
+
+        uint32_t node_index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+        nodes[node_index].axis = static_cast<uint8_t>(t.axis);
+
+        emit_top(*t.children[0]);
+        uint32_t second_child = static_cast<uint32_t>(nodes.size());
+        emit_top(*t.children[1]);
+
+        merge_bounds(nodes[node_index], nodes[node_index + 1], nodes[second_child]);
+        nodes[node_index].offset = second_child;
+    }
+
+    // Split build_prims[start, end), sorted by Morton code, at the highest bit in which the codes of the span differ
+    size_t split_morton(const vector<build_primitive> &build_prims, size_t start, size_t end, int depth, int &axis) const
+    {
+        size_t span = end - start;
+        if (span <= static_cast<size_t>(max_leaf_size))
+            return end;
+
+        uint64_t first = build_prims[start].morton;
+        uint64_t last = build_prims[end - 1].morton;
+
+        // Identical codes (or a too deep tree) have no spatial split left, the sorted order is still coherent though
+        if (first == last || depth >= max_split_depth)
+        {
+            axis = 0;
+            return start + span / 2;
+        }
+
+        // Codes interleave as ...xyzxyz, so the bit position tells the axis
+        int bit = 63 - std::countl_zero(first ^ last);
+        uint64_t mask = uint64_t(1) << bit;
+        axis = 2 - bit % 3;
+
+        auto it = std::partition_point(build_prims.begin() + start, build_prims.begin() + end,
+                                       [mask](const build_primitive &p)
+                                       { return (p.morton & mask) == 0; });
+        return it - build_prims.begin();
+    }
+
+    // Spread the lower 21 bits of v so that two zero bits follow each of them
+    static uint64_t expand_bits(uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    // Assign 30-bit (small scenes) or 63-bit Morton codes to the centroids and reorder build_prims along the curve
+    static void sort_by_morton(ThreadPool &pool, vector<build_primitive> &build_prims)
+    {
+        size_t n = build_prims.size();
+        size_t chunk_count = std::min(n, subtrees_per_worker * pool.Size());
+        size_t chunk_size = (n + chunk_count - 1) / chunk_count;
+        auto chunk_begin = [=](size_t c)
+        { return std::min(n, c * chunk_size); };
+
+        aabb centroid_bounds = pool.ParallelReduce(
+            0, n, aabb(), [&](size_t begin, size_t end)
+            {
+                aabb bounds;
+                for (size_t i = begin; i < end; ++i)
+                    bounds = aabb(bounds, aabb(build_prims[i].centroid, build_prims[i].centroid));
+                return bounds; },
+            [](const aabb &a, const aabb &b)
+            { return aabb(a, b); });
+
+        int bits_per_axis = n <= morton_30bit_limit ? 10 : 21;
+        double cells = static_cast<double>((1 << bits_per_axis) - 1);
+
+        vector<morton_key> keys(n);
+        pool.ParallelFor(0, chunk_count, [&](size_t c)
+                         {
+                             for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+                             {
+                                 uint64_t code = 0;
+                                 for (int a = 0; a < 3; ++a)
+                                 {
+                                     const interval &extent = centroid_bounds.axis(a);
+                                     double f = extent.size() > 0 ? (build_prims[i].centroid[a] - extent.min) / extent.size() : 0.0;
+                                     code |= expand_bits(static_cast<uint64_t>(f * cells)) << (2 - a);
+                                 }
+                                 keys[i] = {code, static_cast<uint32_t>(i)};
+                             } });
+
+        // LSD radix sort, 8 bits per pass: per-chunk histograms, a prefix sum over (digit, chunk), then a stable scatter
+        vector<morton_key> sorted(n);
+        vector<std::array<size_t, 256>> offsets(chunk_count);
+        for (int shift = 0; shift < 3 * bits_per_axis; shift += 8)
+        {
+            pool.ParallelFor(0, chunk_count, [&](size_t c)
+                             {
+                                 offsets[c].fill(0);
+                                 for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+                                     ++offsets[c][(keys[i].code >> shift) & 0xff]; });
+
+            size_t sum = 0;
+            for (int d = 0; d < 256; ++d)
+            {
+                for (size_t c = 0; c < chunk_count; ++c)
+                {
+                    size_t count = offsets[c][d];
+                    offsets[c][d] = sum;
+                    sum += count;
+                }
+            }
+
+            pool.ParallelFor(0, chunk_count, [&](size_t c)
+                             {
+                                 for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+                                     sorted[offsets[c][(keys[i].code >> shift) & 0xff]++] = keys[i]; });
+
+            keys.swap(sorted);
+        }
+
+        vector<build_primitive> reordered(n);
+        pool.ParallelFor(0, chunk_count, [&](size_t c)
+                         {
+                             for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+                             {
+                                 reordered[i] = build_prims[keys[i].index];
+                                 reordered[i].morton = keys[i].code;
+                             } });
+        build_prims.swap(reordered);
+    }
+};
@@ -3,16 +3,84 @@
 #include "Numeric.hpp"
 
 
+#include <atomic>
+#include <cstdint>
+#include <limits>
 #include <random>
 
 MATH_NAMESPACE_BEGIN
 
-static MATH_INLINE std::mt19937 &random_engine()
+// PCG32 (O'Neill, pcg-random.org), 64-bit state with a selectable stream and 32-bit output
+// Meets UniformRandomBitGenerator so the std distributions still work on top of it
+class pcg32
 {
-    static thread_local std::mt19937 gen(std::random_device{}());
+public:
+    using result_type = uint32_t;
+
+    pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+    pcg32(uint64_t init_state, uint64_t init_stream) { seed(init_state, init_stream); }
+
+    void seed(uint64_t init_state, uint64_t init_stream)
+    {
+        state = 0;
+        inc = (init_stream << 1) | 1;
+        (*this)();
+        state += init_state;
+        (*this)();
+    }
+
+    MATH_INLINE result_type operator()()
+    {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18) ^ old_state) >> 27);
+        uint32_t rot = static_cast<uint32_t>(old_state >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1) & 31));
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+private:
+    uint64_t state;
+    uint64_t inc;
+};
+
+// SplitMix64 finalizer, spreads nearby seeds (pixel indices) over the whole state space
+static MATH_INLINE uint64_t mix_bits(uint64_t v)
+{
+    v ^= v >> 30;
+    v *= 0xbf58476d1ce4e5b9ULL;
+    v ^= v >> 27;
+    v *= 0x94d049bb133111ebULL;
+    v ^= v >> 31;
+    return v;
+}
+
+static MATH_INLINE pcg32 &random_engine()
+{
+    // Threads that are never seeded explicitly still get distinct streams
+    static std::atomic<uint64_t> next_stream = 0;
+    static thread_local pcg32 gen(0x853c49e6748fea9bULL, next_stream++);
     return gen;
 }
 
+// Restart the calling thread's sequence, renders seed per pixel sample so results do not depend on the thread count
+static MATH_INLINE void seed_random(uint64_t seed, uint64_t stream = 0)
+{
+    random_engine().seed(mix_bits(seed), stream);
+}
+
+// Maps 32 random bits straight to [0, 1), 24 bits for float and all 32 for double
+template <typename T>
+static MATH_INLINE T random_unit(uint32_t bits)
+{
+    if constexpr (std::is_same<T, float>::value)
+        return static_cast<float>(bits >> 8) * 0x1p-24f;
+    else
+        return static_cast<T>(bits) * static_cast<T>(0x1p-32);
+}
+
 // Returns a random number in the range [0, 1).
 template <typename T>
 static MATH_INLINE T random()
@@ -21,13 +89,11 @@ static MATH_INLINE T random()
 
     if constexpr (std::is_integral<T>::value)
     {
-        std::uniform_int_distribution<T> dis(0, 1);
-        return dis(random_engine());
+        return static_cast<T>(random_engine()() & 1);
     }
     else
     {
-        std::uniform_real_distribution<T> dis(static_cast<T>(0), static_cast<T>(1));
-        return dis(random_engine());
+        return random_unit<T>(random_engine()());
     }
 }
 
@@ -43,8 +109,7 @@ static MATH_INLINE T random_range(T const &min = std::numeric_limits<T>::min(),
     }
     else
     {
-        std::uniform_real_distribution<T> dis(min, max);
-        return dis(random_engine());
+        return min + (max - min) * random_unit<T>(random_engine()());
     }
 }
 
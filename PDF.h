@@ -5,12 +5,33 @@
 #include "hittable.h"
 #include "BRDFComponents.h"
 
+#include <algorithm>
+#include <array>
+#include <initializer_list>
 #include <memory>
 #include <numeric>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+// Uniform direction on the unit sphere from a 2D sample
+inline vec3 uniform_sphere_direction(const vec2d &u)
+{
+    auto z = 1 - 2 * u.x;
+    auto r = sqrt(fmax(0.0, 1 - z * z));
+    auto phi = 2 * Math::M_PI * u.y;
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// Stretch x from [start, start + width) back over [0, 1), for a sample dimension that already made a discrete choice
+inline double remap(double x, double start, double width)
+{
+    return fmin(fmax((x - start) / width, 0.0), 1 - 0x1p-53);
+}
+
 // Any pdf class(or subclass) should be able of
-// 1. Returning a random direction weighted by the internal PDF distribution
+// 1. Returning a random direction weighted by the internal PDF distribution, driven by a 2D sample u in [0, 1)^2
 // 2. Returning the corresponding PDF distribution value in that direction
 class pdf
 {
@@ -18,7 +39,7 @@ public:
     virtual ~pdf(){};
 
     virtual double value(const vec3 &direction) const = 0;
-    virtual vec3 generate() const = 0;
+    virtual vec3 generate(const vec2d &u) const = 0;
 };
 
 class uniform_sphere_pdf : public pdf
@@ -31,9 +52,9 @@ public:
         return 1.0 / (4.0 * Math::M_PI);
     }
 
-    vec3 generate() const override
+    vec3 generate(const vec2d &u) const override
     {
-        return random_spherical_surface();
+        return uniform_sphere_direction(u);
     }
 };
 
@@ -47,9 +68,10 @@ public:
         return 1.0 / (2.0 * Math::M_PI);
     }
 
-    vec3 generate() const override
+    vec3 generate(const vec2d &u) const override
     {
-        return random_hemisphere_surface(normal);
+        vec3 direction = uniform_sphere_direction(u);
+        return dot(direction, normal) > 0 ? direction : -direction;
     }
 
 private:
@@ -67,18 +89,18 @@ public:
         return fmax(0.0, cos_theta / Math::M_PI);
     }
 
-    vec3 generate() const override
+    vec3 generate(const vec2d &u) const override
     {
-        return coord.local(random_cosine_direction());
+        return coord.local(random_cosine_direction(u));
     }
 
 private:
     onb coord;
 
-    vec3 random_cosine_direction() const
+    vec3 random_cosine_direction(const vec2d &u) const
     {
-        auto r1 = Math::random_range(0.0, 1.0);
-        auto r2 = Math::random_range(0.0, 1.0);
+        auto r1 = u.x;
+        auto r2 = u.y;
 
         auto phi = 2 * Math::M_PI * r1;
 
@@ -101,19 +123,19 @@ public:
         return distributionGGX(coord.w, normalize(direction), alpha) * cos_theta / Math::M_PI;
     }
 
-    vec3 generate() const override
+    vec3 generate(const vec2d &u) const override
     {
-        return coord.local(GGX_sample(alpha));
+        return coord.local(GGX_sample(alpha, u));
     }
 
 private:
     onb coord;
     float alpha;
 
-    vec3 GGX_sample(float alpha) const
+    vec3 GGX_sample(float alpha, const vec2d &u) const
     {
-        auto r1 = Math::random_range(0.0, 1.0);
-        auto r2 = Math::random_range(0.0, 1.0);
+        auto r1 = u.x;
+        auto r2 = u.y;
 
         auto a2 = alpha * alpha;
 
@@ -139,19 +161,19 @@ public:
         return distributionBeckmann(coord.w, normalize(direction), alpha) * cos_theta / Math::M_PI;
     }
 
-    vec3 generate() const override
+    vec3 generate(const vec2d &u) const override
     {
-        return coord.local(Beckmann_sample(alpha));
+        return coord.local(Beckmann_sample(alpha, u));
     }
 
 private:
     onb coord;
     float alpha;
 
-    vec3 Beckmann_sample(float alpha) const
+    vec3 Beckmann_sample(float alpha, const vec2d &u) const
     {
-        auto r1 = Math::random_range(0.0, 1.0);
-        auto r2 = Math::random_range(0.0, 1.0);
+        auto r1 = u.x;
+        auto r2 = u.y;
 
         auto a2 = alpha * alpha;
 
@@ -176,9 +198,9 @@ public:
         return objects.pdf_value(origin, direction);
     }
 
-    vec3 generate() const override
+    vec3 generate(const vec2d &u) const override
     {
-        return objects.random(origin);
+        return objects.random(origin, u);
     }
 
 private:
@@ -186,21 +208,21 @@ private:
     point3 origin;
 };
 
+// Mixes pdfs passed as pointers (const pdf *), the mixture does not own them
 template <typename... Args>
 class mixture_pdf : public pdf
 {
 public:
     // Require the same number of pdfs and weights if not default to 1.0 / num_pdfs
-    mixture_pdf(std::vector<double> _weights = std::vector<double>(), Args... args)
+    mixture_pdf(std::initializer_list<double> _weights, Args... args) : src_pdfs{args...}
     {
-        src_pdfs = {args...};
         if (_weights.size() != src_pdfs.size())
         {
-            weights = std::vector<double>(src_pdfs.size(), 1.0 / src_pdfs.size());
+            weights.fill(1.0 / src_pdfs.size());
         }
         else
         {
-            weights = _weights;
+            std::copy(_weights.begin(), _weights.end(), weights.begin());
         }
         weight_sum = std::accumulate(weights.begin(), weights.end(), 0.0);
     }
@@ -215,23 +237,92 @@ public:
         return result / weight_sum;
     }
 
-    vec3 generate() const override
+    // u.x picks the component and is then stretched back over [0, 1) for it
+    vec3 generate(const vec2d &u) const override
     {
-        double random_num = random_double() * weight_sum;
+        double random_num = u.x * weight_sum;
         double sum = 0.0;
         for (int i = 0; i < src_pdfs.size(); i++)
         {
             sum += weights[i];
             if (sum > random_num)
             {
-                return src_pdfs[i]->generate();
+                return src_pdfs[i]->generate(vec2d(remap(random_num, sum - weights[i], weights[i]), u.y));
             }
         }
-        return src_pdfs.back()->generate();
+        return src_pdfs.back()->generate(u);
     }
 
 private:
-    std::vector<std::shared_ptr<pdf>> src_pdfs;
-    std::vector<double> weights;
+    std::array<const pdf *, sizeof...(Args)> src_pdfs;
+    std::array<double, sizeof...(Args)> weights;
     double weight_sum;
+};
+
+// Compile time mixture, the components live in a tuple so value() and generate() dispatch without virtual calls
+// A component is either a pdf held by value or a pointer to a pdf owned elsewhere (e.g. the one a material returned)
+template <typename... Pdfs>
+class static_mixture_pdf final : public pdf
+{
+public:
+    static_mixture_pdf(const std::array<double, sizeof...(Pdfs)> &_weights, Pdfs... _pdfs) : pdfs(std::move(_pdfs)...), weights(_weights)
+    {
+        weight_sum = std::accumulate(weights.begin(), weights.end(), 0.0);
+    }
+
+    double value(const vec3 &direction) const override
+    {
+        return value_impl(direction, std::index_sequence_for<Pdfs...>{}) / weight_sum;
+    }
+
+    // u.x picks the component and is then stretched back over [0, 1) for it
+    vec3 generate(const vec2d &u) const override
+    {
+        return generate_impl(u, std::index_sequence_for<Pdfs...>{});
+    }
+
+private:
+    std::tuple<Pdfs...> pdfs;
+    std::array<double, sizeof...(Pdfs)> weights;
+    double weight_sum;
+
+    template <size_t... I>
+    double value_impl(const vec3 &direction, std::index_sequence<I...>) const
+    {
+        return ((weights[I] * component_value(std::get<I>(pdfs), direction)) + ...);
+    }
+
+    template <size_t... I>
+    vec3 generate_impl(const vec2d &u, std::index_sequence<I...>) const
+    {
+        vec3 result;
+        double random_num = u.x * weight_sum;
+        double sum = 0.0;
+
+        // Stops at the first component whose accumulated weight passes random_num
+        bool generated = ((sum += weights[I], sum > random_num && (result = component_generate(std::get<I>(pdfs), vec2d(remap(random_num, sum - weights[I], weights[I]), u.y)), true)) || ...);
+        if (!generated)
+            result = component_generate(std::get<sizeof...(Pdfs) - 1>(pdfs), u);
+
+        return result;
+    }
+
+    // Pdfs held by value are called qualified, which skips the virtual dispatch
+    template <typename T>
+    static double component_value(const T &p, const vec3 &direction)
+    {
+        if constexpr (std::is_pointer_v<T>)
+            return p->value(direction);
+        else
+            return p.T::value(direction);
+    }
+
+    template <typename T>
+    static vec3 component_generate(const T &p, const vec2d &u)
+    {
+        if constexpr (std::is_pointer_v<T>)
+            return p->generate(u);
+        else
+            return p.T::generate(u);
+    }
 };
\ No newline at end of file
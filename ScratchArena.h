@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator for the short-lived objects of one sample path (pdfs built while scattering)
+// Every thread owns one through Local(), the camera resets it before each path, blocks are kept for reuse
+class ScratchArena
+{
+public:
+    explicit ScratchArena(size_t _block_size = 16 * 1024) : block_size(_block_size) {}
+    ~ScratchArena() { Reset(); }
+
+    ScratchArena(const ScratchArena &) = delete;
+    ScratchArena &operator=(const ScratchArena &) = delete;
+
+    void *Allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+    {
+        while (current < blocks.size())
+        {
+            Block &block = blocks[current];
+            uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+            uintptr_t aligned = (base + used + alignment - 1) & ~(uintptr_t(alignment) - 1);
+
+            if (aligned + size <= base + block.size)
+            {
+                used = aligned + size - base;
+                return reinterpret_cast<void *>(aligned);
+            }
+
+            // Move on to the next block, one that is too small for this request is simply skipped
+            ++current;
+            used = 0;
+        }
+
+        size_t size_needed = size + alignment;
+        blocks.push_back(Block{std::make_unique<std::byte[]>(std::max(block_size, size_needed)), std::max(block_size, size_needed)});
+        return Allocate(size, alignment);
+    }
+
+    // Objects with a non-trivial destructor are destroyed on Reset(), in reverse order of creation
+    template <typename T, typename... Args>
+    T *Create(Args &&...args)
+    {
+        T *object = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+
+        if constexpr (!std::is_trivially_destructible_v<T>)
+        {
+            void *node = Allocate(sizeof(Destructor), alignof(Destructor));
+            destructors = new (node) Destructor{[](void *p) { static_cast<T *>(p)->~T(); }, object, destructors};
+        }
+
+        return object;
+    }
+
+    // Release everything created since the last reset, the memory itself is not given back
+    void Reset()
+    {
+        for (Destructor *d = destructors; d != nullptr; d = d->next)
+            d->destroy(d->object);
+
+        destructors = nullptr;
+        current = 0;
+        used = 0;
+    }
+
+    // Arena of the calling thread
+    static ScratchArena &Local()
+    {
+        thread_local ScratchArena arena;
+        return arena;
+    }
+
+private:
+    struct Block
+    {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    struct Destructor
+    {
+        void (*destroy)(void *);
+        void *object;
+        Destructor *next;
+    };
+
+    std::vector<Block> blocks;
+    size_t block_size;
+    size_t current = 0; // Block being bumped
+    size_t used = 0;    // Bytes taken from the current block
+    Destructor *destructors = nullptr;
+};
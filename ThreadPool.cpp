@@ -3,15 +3,21 @@
 // 声明一个 thread_local 变量来保存当前线程在队列中的索引
 // 初始化为 -1 表示不是线程池中的线程
 thread_local int tls_queue_index = -1;
+// 当前线程所属的线程池, 只有它自己的 worker 才能向本地队列 push
+thread_local ThreadPool *tls_pool = nullptr;
+// Work-Stealing 时随机选择受害者的 xorshift 状态
+thread_local uint32_t tls_steal_rng = 0x2545f491u;
+// 每个线程回收的任务节点
+thread_local ThreadPool::TaskFreelist ThreadPool::task_freelist;
 
-ThreadPool::ThreadPool(size_t numThreads) : terminate(false), submit_index(0)
+ThreadPool::ThreadPool(size_t numThreads) : injected_count(0), terminate(false), sleep_epoch(0), sleepers(0), waiting(0)
 {
     if (numThreads == 0)
         numThreads = 1;
 
     for (size_t i = 0; i < numThreads; ++i)
     {
-        queues.emplace_back(std::make_unique<WorkQueue>());
+        queues.emplace_back(std::make_unique<WorkStealingDeque<Task>>());
     }
 
     for (size_t i = 0; i < numThreads; ++i)
@@ -23,7 +29,8 @@ ThreadPool::ThreadPool(size_t numThreads) : terminate(false), submit_index(0)
 ThreadPool::~ThreadPool()
 {
     terminate = true;
-    sleep_cv.notify_all();
+    sleep_epoch.fetch_add(1, std::memory_order_seq_cst);
+    sleep_epoch.notify_all();
     for (std::thread &worker : workers)
     {
         if (worker.joinable())
@@ -31,60 +38,249 @@ ThreadPool::~ThreadPool()
             worker.join();
         }
     }
+
+    // Tasks nobody got to, their futures report a broken promise
+    for (auto &queue : queues)
+    {
+        while (Task *task = queue->Pop())
+            Discard(task);
+    }
+    for (Task *task : injected)
+        Discard(task);
 }
 
-void ThreadPool::WorkerRoutine(size_t index)
+ThreadPool::TaskFreelist::~TaskFreelist()
 {
-    tls_queue_index = static_cast<int>(index);
-    const size_t numQueues = queues.size();
+    while (head != nullptr)
+    {
+        Task *task = head;
+        head = task->next;
+        delete task;
+    }
+}
 
-    while (!terminate)
+ThreadPool::Task *ThreadPool::AllocateTask()
+{
+    TaskFreelist &freelist = task_freelist;
+    if (freelist.head == nullptr)
+        return new Task;
+
+    Task *task = freelist.head;
+    freelist.head = task->next;
+    --freelist.count;
+    return task;
+}
+
+void ThreadPool::FreeTask(Task *task)
+{
+    TaskFreelist &freelist = task_freelist;
+    if (freelist.count >= TaskFreelist::max_nodes)
+    {
+        delete task;
+        return;
+    }
+
+    task->next = freelist.head;
+    freelist.head = task;
+    ++freelist.count;
+}
+
+void ThreadPool::Schedule(Task *task)
+{
+    if (tls_pool == this)
     {
-        std::function<void()> task;
+        // Worker of this pool: push to its own deque, where it runs LIFO and others steal FIFO
+        queues[tls_queue_index]->Push(task);
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(inject_mtx);
+        injected.push_back(task);
+        injected_count.fetch_add(1, std::memory_order_release);
+    }
 
-        // 1. 尝试从本地队列 (LIFO 模式有助于缓存热度) 弹出
+    WakeOne();
+}
+
+void ThreadPool::WakeOne()
+{
+    // Pairs with the fence in Park(): either the sleeper sees the new task on its last check, or we see the sleeper here
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_relaxed) != 0)
+    {
+        sleep_epoch.fetch_add(1, std::memory_order_seq_cst);
+        sleep_epoch.notify_one();
+    }
+    else if (waiting.load(std::memory_order_acquire) != 0)
+    {
+        // Every worker is busy, a thread blocked in Wait() can help instead
+        WakeWaiter();
+    }
+}
+
+void ThreadPool::WakeWaiter()
+{
+    for (WaitSlot &slot : wait_slots)
+    {
+        if (slot.waiters.load(std::memory_order_relaxed) != 0)
         {
-            std::unique_lock<std::mutex> lock(queues[index]->mtx);
-            if (!queues[index]->tasks.empty())
-            {
-                task = std::move(queues[index]->tasks.back());
-                queues[index]->tasks.pop_back();
-            }
+            slot.epoch.fetch_add(1, std::memory_order_seq_cst);
+            slot.epoch.notify_all();
+            return;
         }
+    }
+}
 
-        // 2. 本地队列为空，尝试进行 Work-Stealing
-        if (!task)
+bool ThreadPool::HasWork() const
+{
+    if (terminate || injected_count.load(std::memory_order_relaxed) != 0)
+        return true;
+
+    for (const auto &queue : queues)
+    {
+        if (!queue->Empty())
+            return true;
+    }
+    return false;
+}
+
+void ThreadPool::Park()
+{
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint32_t epoch = sleep_epoch.load(std::memory_order_seq_cst);
+
+    // Anything pushed before the epoch was read is visible now, anything pushed later bumps the epoch and ends the wait
+    if (!HasWork())
+        sleep_epoch.wait(epoch, std::memory_order_seq_cst);
+
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ThreadPool::Park(const std::atomic<size_t> &pending)
+{
+    // The slot count goes first, so a thread that sees waiting also finds the slot
+    WaitSlot &slot = SlotFor(pending);
+    slot.waiters.fetch_add(1, std::memory_order_seq_cst);
+    waiting.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint32_t epoch = slot.epoch.load(std::memory_order_seq_cst);
+
+    // Either the last Finish() on pending sees this waiter and bumps the epoch, or its decrement is visible here
+    // New tasks work the same way through waiting
+    if (pending.load(std::memory_order_seq_cst) != 0 && !HasWork())
+        slot.epoch.wait(epoch, std::memory_order_seq_cst);
+
+    waiting.fetch_sub(1, std::memory_order_relaxed);
+    slot.waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+ThreadPool::WaitSlot &ThreadPool::SlotFor(const std::atomic<size_t> &pending)
+{
+    // Fibonacci hashing of the address, the low bits are mostly alignment
+    uint64_t key = static_cast<uint64_t>(reinterpret_cast<std::uintptr_t>(&pending)) * 0x9e3779b97f4a7c15ull;
+    return wait_slots[key >> (64 - std::bit_width(wait_slot_count - 1))];
+}
+
+void ThreadPool::Wait(const std::atomic<size_t> &pending)
+{
+    while (pending.load(std::memory_order_acquire) != 0)
+    {
+        if (Task *task = FindTask())
         {
-            for (size_t i = 1; i < numQueues; ++i)
-            {
-                size_t steal_index = (index + i) % numQueues;
-                std::unique_lock<std::mutex> lock(queues[steal_index]->mtx,
-                                                  std::try_to_lock);
-                if (lock.owns_lock() && !queues[steal_index]->tasks.empty())
-                {
-                    // 从别人队列的前端偷取 (FIFO，偷取那些久未执行的数据)
-                    task = std::move(queues[steal_index]->tasks.front());
-                    queues[steal_index]->tasks.pop_front();
-                    break;
-                }
-            }
+            Run(task);
         }
+        else
+        {
+            Park(pending);
+        }
+    }
+}
+
+void ThreadPool::Finish(std::atomic<size_t> &pending)
+{
+    // pending may be gone as soon as it reads zero, only its slot in the pool is touched afterwards
+    WaitSlot &slot = SlotFor(pending);
+    if (pending.fetch_sub(1, std::memory_order_seq_cst) != 1)
+        return;
+
+    if (slot.waiters.load(std::memory_order_seq_cst) != 0)
+    {
+        slot.epoch.fetch_add(1, std::memory_order_seq_cst);
+        slot.epoch.notify_all();
+    }
+}
+
+ThreadPool::Task *ThreadPool::FindTask()
+{
+    // 1. 尝试从本地队列 (LIFO 模式有助于缓存热度) 弹出
+    Task *task = tls_pool == this ? queues[tls_queue_index]->Pop() : nullptr;
+
+    // 2. 本地队列为空，先取外部提交的任务，再随机选择其他队列进行 Work-Stealing
+    if (!task)
+        task = TakeInjected();
+    if (!task)
+        task = Steal();
+    return task;
+}
+
+ThreadPool::Task *ThreadPool::TakeInjected()
+{
+    // Skip the lock entirely while nothing was submitted from outside
+    if (injected_count.load(std::memory_order_acquire) == 0)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(inject_mtx);
+    if (injected.empty())
+        return nullptr;
+
+    Task *task = injected.front();
+    injected.pop_front();
+    injected_count.fetch_sub(1, std::memory_order_relaxed);
+    return task;
+}
+
+ThreadPool::Task *ThreadPool::Steal()
+{
+    const size_t numQueues = queues.size();
+    size_t self = tls_pool == this ? static_cast<size_t>(tls_queue_index) : numQueues;
+
+    // Start at a random victim so thieves spread out instead of all hitting the same neighbour
+    uint32_t &rng = tls_steal_rng;
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    size_t first = rng % numQueues;
+
+    for (size_t i = 0; i < numQueues; ++i)
+    {
+        size_t victim = (first + i) % numQueues;
+        if (victim == self)
+            continue;
+        if (Task *task = queues[victim]->Steal())
+            return task;
+    }
+    return nullptr;
+}
+
+void ThreadPool::WorkerRoutine(size_t index)
+{
+    tls_queue_index = static_cast<int>(index);
+    tls_pool = this;
+    tls_steal_rng = 0x9e3779b9u * static_cast<uint32_t>(index + 1);
+
+    while (!terminate)
+    {
+        Task *task = FindTask();
 
-        // 3. 如果依然没有任务，进入条件变量休眠
+        // 3. 如果依然没有任务，休眠直到有新任务提交 (没有超时轮询)
         if (!task)
         {
-            std::unique_lock<std::mutex> sleep_lock(sleep_mtx);
-            sleep_cv.wait_for(
-                sleep_lock, std::chrono::milliseconds(10), [this, index]
-                {
-                    return terminate ||
-                           !queues[index]
-                                ->tasks.empty(); // 简单起见采用超时轮询配合信号
-                });
+            Park();
             continue;
         }
 
         // 4. 执行任务
-        task();
+        Run(task);
     }
 }
@@ -1,18 +1,175 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
-#include <condition_variable>
+#include <bit>
 #include <cstddef>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <stdexcept>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+class ThreadPool;
+
 extern thread_local int tls_queue_index;
+extern thread_local ThreadPool *tls_pool;
+
+// Chase-Lev work-stealing deque (Lê et al. 2013, Correct and Efficient Work-Stealing for Weak Memory Models)
+// The owner pushes and pops at the bottom without any read-modify-write, other threads steal from the top with a CAS
+// Only a pop racing a steal for the last item takes the CAS path as well
+template <typename T>
+class WorkStealingDeque
+{
+public:
+    explicit WorkStealingDeque(size_t capacity = 256) : ring(new Ring(capacity)) {}
+
+    ~WorkStealingDeque() { delete ring.load(std::memory_order_relaxed); }
+
+    WorkStealingDeque(const WorkStealingDeque &) = delete;
+    WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+    // Owner only
+    void Push(T *item)
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Ring *r = ring.load(std::memory_order_relaxed);
+
+        if (b - t >= r->Capacity())
+            r = Grow(r, t, b);
+
+        r->Put(b, item);
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only, LIFO
+    T *Pop()
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Ring *r = ring.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        T *item = r->Get(b);
+        if (t == b)
+        {
+            // Last item, a thief may be taking it at the same time
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                item = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread, FIFO, returns nullptr when empty or when another thread won the item
+    T *Steal()
+    {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+            return nullptr;
+
+        T *item = ring.load(std::memory_order_acquire)->Get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return item;
+    }
+
+    bool Empty() const
+    {
+        return top.load(std::memory_order_relaxed) >= bottom.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Power-of-two circular array, indices grow forever and wrap through the mask
+    struct Ring
+    {
+        explicit Ring(size_t capacity) : mask(static_cast<int64_t>(capacity) - 1), slots(new std::atomic<T *>[capacity]) {}
+
+        int64_t Capacity() const { return mask + 1; }
+        T *Get(int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+        void Put(int64_t i, T *item) { slots[i & mask].store(item, std::memory_order_relaxed); }
+
+        int64_t mask;
+        std::unique_ptr<std::atomic<T *>[]> slots;
+    };
+
+    // Thieves may still be reading the old ring, so it is only freed with the deque
+    Ring *Grow(Ring *old, int64_t t, int64_t b)
+    {
+        Ring *bigger = new Ring(2 * old->Capacity());
+        for (int64_t i = t; i < b; ++i)
+            bigger->Put(i, old->Get(i));
+
+        retired.emplace_back(old);
+        ring.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    // top and bottom live on their own cache lines, thieves hammer the first and the owner the second
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    alignas(64) std::atomic<Ring *> ring;
+    std::vector<std::unique_ptr<Ring>> retired;
+};
+
+// Half-open index range [begin, end) for ThreadPool::ParallelFor
+struct Range1D
+{
+    size_t begin;
+    size_t end;
+
+    size_t Size() const { return end - begin; }
+    bool Divisible(size_t grain) const { return Size() > grain; }
+
+    // Keep the lower half, return the upper one
+    Range1D Split()
+    {
+        size_t mid = begin + Size() / 2;
+        Range1D upper{mid, end};
+        end = mid;
+        return upper;
+    }
+};
+
+// Rows [row_begin, row_end) x columns [col_begin, col_end), halved across the longer side so pieces stay roughly square
+struct Range2D
+{
+    size_t row_begin;
+    size_t row_end;
+    size_t col_begin;
+    size_t col_end;
+
+    size_t Size() const { return (row_end - row_begin) * (col_end - col_begin); }
+    bool Divisible(size_t grain) const { return Size() > grain && Size() > 1; }
+
+    Range2D Split()
+    {
+        Range2D upper = *this;
+        if (row_end - row_begin >= col_end - col_begin)
+            row_end = upper.row_begin = row_begin + (row_end - row_begin) / 2;
+        else
+            col_end = upper.col_begin = col_begin + (col_end - col_begin) / 2;
+        return upper;
+    }
+};
 
 class ThreadPool
 {
@@ -20,60 +177,271 @@ public:
     ThreadPool(size_t numThreads = std::thread::hardware_concurrency());
     ~ThreadPool();
 
+    size_t Size() const { return workers.size(); }
+
     template <typename Func, typename... Args>
     auto Submit(Func &&func, Args &&...args)
         -> std::future<decltype(func(args...))>
     {
         using return_type = decltype(func(args...));
+
+        if (terminate)
+        {
+            throw std::runtime_error("Submit on stopped ThreadPool");
+        }
+
         auto task = std::make_shared<std::packaged_task<return_type()>>(
             std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
         std::future<return_type> result = task->get_future();
 
-        auto wrapper = [task]()
-        { (*task)(); };
+        Schedule(MakeTask([task]()
+                          { (*task)(); }));
+        return result;
+    }
 
+    // Fire-and-forget: no future and no heap allocation once the calling thread's task freelist is warm
+    // func must not throw, and its captures have to fit in Task::capacity bytes
+    template <typename Func>
+    void Launch(Func &&func)
+    {
         if (terminate)
         {
-            throw std::runtime_error("Submit on stopped ThreadPool");
+            throw std::runtime_error("Launch on stopped ThreadPool");
         }
 
-        int i = tls_queue_index;
-        if (i == -1)
-        {
-            i = submit_index.fetch_add(1, std::memory_order_relaxed) % queues.size();
-        }
+        Schedule(MakeTask(std::forward<Func>(func)));
+    }
 
-        {
-            std::unique_lock<std::mutex> lock(queues[i]->mtx);
-            queues[i]->tasks.emplace_back(std::move(wrapper));
-        }
+    // Same, and pending counts the task until it has run, Wait(pending) then returns once all of them are done
+    template <typename Func>
+    void Launch(Func &&func, std::atomic<size_t> &pending)
+    {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        Launch([this, &pending, func = std::forward<Func>(func)]() mutable
+               {
+                   func();
+                   Finish(pending); });
+    }
 
-        sleep_cv.notify_one();
+    // Run tasks of the pool until pending drops to zero, sleeping only while there is nothing to help with
+    // Safe to call from inside a pool task, the waiting thread keeps working instead of blocking
+    void Wait(const std::atomic<size_t> &pending);
+
+    // Run body(subrange) over pieces covering range and return once all of them are done
+    // The range is halved recursively, the calling thread keeps the lower half and leaves the upper one to thieves,
+    // so the first steals take the largest pieces. Splitting stops at about 4 pieces per worker unless pieces get
+    // stolen, a stolen piece may split further (auto partitioning), and never below grain elements
+    // The caller runs pieces itself while waiting, so this may be called from inside a pool task
+    template <typename Range, typename Body>
+    void ParallelFor(Range range, const Body &body, size_t grain = 1)
+    {
+        if (range.Size() == 0)
+            return;
+
+        std::atomic<size_t> pending(1);
+        SplitRange(range, std::max<size_t>(grain, 1), InitialSplits(), body, pending);
+        Wait(pending);
+    }
+
+    // func(i) for every i in [begin, end)
+    template <typename Func>
+    void ParallelFor(size_t begin, size_t end, const Func &func, size_t grain = 1)
+    {
+        ParallelFor(Range1D{begin, end}, [&func](const Range1D &r)
+                    {
+                        for (size_t i = r.begin; i < r.end; ++i)
+                            func(i); }, grain);
+    }
+
+    // func(i, j) for every row i in [0, rows) and column j in [0, cols)
+    template <typename Func>
+    void ParallelFor2D(size_t rows, size_t cols, const Func &func, size_t grain = 1)
+    {
+        ParallelFor(Range2D{0, rows, 0, cols}, [&func](const Range2D &r)
+                    {
+                        for (size_t i = r.row_begin; i < r.row_end; ++i)
+                            for (size_t j = r.col_begin; j < r.col_end; ++j)
+                                func(i, j); }, grain);
+    }
+
+    // Fold [begin, end) into one value: map(chunk_begin, chunk_end) -> T per chunk, then combine(T, T) -> T
+    // The chunks only depend on the range and the pool size and are combined in order, so floating point
+    // results come out the same on every run
+    template <typename T, typename Map, typename Combine>
+    T ParallelReduce(size_t begin, size_t end, T identity, const Map &map, const Combine &combine, size_t grain = 1)
+    {
+        if (begin >= end)
+            return identity;
+
+        size_t n = end - begin;
+        size_t chunk_count = std::min(std::max<size_t>(n / std::max<size_t>(grain, 1), 1), 4 * Size());
+        size_t chunk_size = (n + chunk_count - 1) / chunk_count;
+        chunk_count = (n + chunk_size - 1) / chunk_size;
+
+        std::vector<T> partials(chunk_count, identity);
+        ParallelFor(0, chunk_count, [&](size_t c)
+                    { partials[c] = map(begin + c * chunk_size, std::min(end, begin + (c + 1) * chunk_size)); });
+
+        T result = identity;
+        for (const T &partial : partials)
+            result = combine(result, partial);
         return result;
     }
 
 private:
-    struct WorkQueue
+    // Task node with the callable stored inline, two cache lines in total
+    // Nodes are recycled through a per-thread freelist instead of going back to the heap
+    struct alignas(64) Task
+    {
+        static constexpr size_t capacity = 112;
+
+        alignas(std::max_align_t) unsigned char storage[capacity];
+        void (*call)(Task *, bool run); // Runs the callable when run is set, then destroys it
+        Task *next;                     // Freelist link
+    };
+
+    // Nodes freed by one thread, capped so a thread that only runs tasks others create does not hoard them
+    struct TaskFreelist
     {
-        std::deque<std::function<void()>> tasks;
-        std::mutex mtx;
+        static constexpr size_t max_nodes = 1024;
+
+        Task *head = nullptr;
+        size_t count = 0;
+
+        ~TaskFreelist();
     };
 
-    std::vector<std::unique_ptr<WorkQueue>> queues;
+    static thread_local TaskFreelist task_freelist;
+
+    static Task *AllocateTask();
+    static void FreeTask(Task *task);
+
+    template <typename Func>
+    static Task *MakeTask(Func &&func)
+    {
+        using Callable = std::decay_t<Func>;
+        static_assert(sizeof(Callable) <= Task::capacity, "task captures too large for the inline storage");
+        static_assert(alignof(Callable) <= alignof(std::max_align_t), "task captures over-aligned");
+
+        Task *task = AllocateTask();
+        new (task->storage) Callable(std::forward<Func>(func));
+        task->call = [](Task *t, bool run)
+        {
+            Callable *callable = std::launder(reinterpret_cast<Callable *>(t->storage));
+            if (run)
+                (*callable)();
+            callable->~Callable();
+        };
+        return task;
+    }
+
+    static void Run(Task *task)
+    {
+        task->call(task, true);
+        FreeTask(task);
+    }
+
+    static void Discard(Task *task)
+    {
+        task->call(task, false);
+        FreeTask(task);
+    }
+
+    // One deque per worker, only that worker pushes to it
+    std::vector<std::unique_ptr<WorkStealingDeque<Task>>> queues;
     std::vector<std::thread> workers;
 
+    // Tasks submitted from threads outside the pool, picked up by whichever worker runs dry first
+    std::mutex inject_mtx;
+    std::deque<Task *> injected;
+    std::atomic<size_t> injected_count;
+
     std::atomic<bool> terminate;
-    std::atomic<size_t> submit_index;
 
-    // 用于在没有任务时休眠的工作机制
-    std::mutex sleep_mtx;
-    std::condition_variable sleep_cv;
+    // 用于在没有任务时休眠的工作机制: event count on top of C++20 atomic wait/notify
+    // Idle workers register in sleepers and block on sleep_epoch, a submit bumps the epoch only when someone sleeps
+    std::atomic<uint32_t> sleep_epoch;
+    std::atomic<uint32_t> sleepers;
+
+    // Threads in Wait() park on the slot of their group instead, so finishing a group wakes only its waiter
+    // Groups are hashed onto the slots by address, a collision just costs a spurious wakeup
+    struct alignas(64) WaitSlot
+    {
+        std::atomic<uint32_t> epoch{0};
+        std::atomic<uint32_t> waiters{0};
+    };
+    static constexpr size_t wait_slot_count = 64;
+    WaitSlot wait_slots[wait_slot_count];
+    std::atomic<uint32_t> waiting; // Threads parked on any slot, woken for new tasks once no idle worker is left
 
+    void Schedule(Task *task);
+    void WakeOne();
+    void WakeWaiter();
+    bool HasWork() const;
+    void Park();
+    void Park(const std::atomic<size_t> &pending);
+    WaitSlot &SlotFor(const std::atomic<size_t> &pending);
+    Task *FindTask();
+    Task *TakeInjected();
+    Task *Steal();
     void WorkerRoutine(size_t index);
 
+    // Count one piece of work as done, the last one wakes the waiter
+    void Finish(std::atomic<size_t> &pending);
+
+    int InitialSplits() const { return std::bit_width(4 * Size() - 1); }
+    int StealSplits() const { return std::bit_width(Size()); }
+
+    template <typename Range, typename Body>
+    void SplitRange(Range range, size_t grain, int splits, const Body &body, std::atomic<size_t> &pending)
+    {
+        while (splits > 0 && range.Divisible(grain))
+        {
+            --splits;
+            pending.fetch_add(1, std::memory_order_relaxed);
+
+            int spawner = tls_queue_index;
+            Schedule(MakeTask([this, upper = range.Split(), grain, splits, spawner, &body, &pending]
+                              {
+                                  // A stolen piece means some thread ran dry, let it split again
+                                  int budget = tls_queue_index == spawner ? splits : std::max(splits, StealSplits());
+                                  SplitRange(upper, grain, budget, body, pending);
+                              }));
+        }
+
+        body(range);
+        Finish(pending);
+    }
+
 public:
     ThreadPool(const ThreadPool &) = delete;
     ThreadPool &operator=(const ThreadPool &) = delete;
     ThreadPool(ThreadPool &&) = delete;
     ThreadPool &operator=(ThreadPool &&) = delete;
 };
+
+// Tasks started together and waited for together
+// Wait() runs pool tasks until every task of the group has finished, so groups nest: a task of one group may start
+// and wait for a group of its own without blocking its worker. The destructor waits as well
+class TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool &_pool) : pool(_pool) {}
+    ~TaskGroup() { Wait(); }
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    // Same constraints as ThreadPool::Launch, plus the group pointer
+    template <typename Func>
+    void Run(Func &&func)
+    {
+        pool.Launch(std::forward<Func>(func), pending);
+    }
+
+    void Wait() { pool.Wait(pending); }
+
+private:
+    ThreadPool &pool;
+    std::atomic<size_t> pending{0};
+};
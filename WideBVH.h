@@ -0,0 +1,418 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "BVH.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+// SIMD paths of the box tests, everything else falls back to plain loops
+#if defined(__AVX__)
+    #define WIDE_BVH_AVX
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define WIDE_BVH_SSE
+#endif
+#if defined(WIDE_BVH_AVX) || defined(WIDE_BVH_SSE)
+    #include <immintrin.h>
+#endif
+
+// N-wide BVH node, bounds stored SoA so one SIMD register holds the same plane of all children
+// A child is either another node (count == 0) or a leaf of count primitives starting at child, leaves live inline
+template <int N>
+struct alignas(32) wide_bvh_node
+{
+    float bounds_min[3][N];
+    float bounds_max[3][N];
+    uint32_t child[N];
+    uint16_t count[N];
+
+    static constexpr uint32_t empty = std::numeric_limits<uint32_t>::max(); // Unused slots, their bounds never hit
+};
+
+// BVH4 / BVH8 collapsed from a binary flat_bvh, testing all children of a node against the ray at once
+template <int N>
+class wide_bvh : public hittable
+{
+    static_assert(N == 4 || N == 8, "wide_bvh is 4 or 8 wide");
+
+public:
+    wide_bvh(const hittable_list &list, ThreadPool &pool, bvh_build_method method = bvh_build_method::sah, int max_leaf_size = 4)
+    {
+        flat_bvh binary(list, pool, method, max_leaf_size);
+        primitives = binary.primitive_array();
+        if (primitives.empty())
+            return;
+
+        primitive_ptrs.resize(primitives.size());
+        for (size_t i = 0; i < primitives.size(); ++i)
+            primitive_ptrs[i] = primitives[i].get();
+
+        const vector<flat_bvh_node> &binary_nodes = binary.node_array();
+        nodes.reserve(binary_nodes.size() / (N / 2) + 1);
+        collapse(binary_nodes, 0);
+        nodes.shrink_to_fit();
+
+        bbox = binary.bounding_box();
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_info &hit) const override
+    {
+        if (!intersect(r, ray_t, hit))
+            return false;
+
+        complete(r, hit);
+        return true;
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_info &hit) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        lane_ray lanes(r);
+        float t_min = round_down(ray_t.min);
+        float t_max = round_up(ray_t.max);
+
+        struct stack_entry
+        {
+            uint32_t node;
+            float t_enter;
+        };
+        stack_entry stack[max_stack_size];
+        int stack_size = 0;
+        stack[stack_size++] = {0, t_min};
+
+        bool hit_any = false;
+
+        while (stack_size > 0)
+        {
+            stack_entry entry = stack[--stack_size];
+
+            // Something closer has been found since this node was pushed
+            // Entry distances are float estimates, so they are culled against the padded t_max as in the slab test
+            if (entry.t_enter > t_max * slab_exit_scale)
+                continue;
+
+            const wide_bvh_node<N> &node = nodes[entry.node];
+
+            alignas(32) float t_enter[N];
+            unsigned mask = intersect_children(node, lanes, t_min, t_max, t_enter);
+
+            // Order the children that were hit near to far
+            int order[N];
+            int hit_count = 0;
+            while (mask)
+            {
+                int k = std::countr_zero(mask);
+                mask &= mask - 1;
+
+                int pos = hit_count++;
+                while (pos > 0 && t_enter[order[pos - 1]] > t_enter[k])
+                {
+                    order[pos] = order[pos - 1];
+                    --pos;
+                }
+                order[pos] = k;
+            }
+
+            // Leaves are intersected right away, inner children go onto the stack far to near so the nearest pops first
+            int inner[N];
+            int inner_count = 0;
+            for (int i = 0; i < hit_count; ++i)
+            {
+                int k = order[i];
+                if (t_enter[k] > t_max * slab_exit_scale)
+                    break;
+
+                if (node.count[k] == 0)
+                {
+                    inner[inner_count++] = k;
+                    continue;
+                }
+
+                for (uint32_t p = node.child[k]; p < node.child[k] + node.count[k]; ++p)
+                {
+                    if (primitive_ptrs[p]->intersect(r, ray_t, hit))
+                    {
+                        hit_any = true;
+                        ray_t.max = hit.t;
+                        t_max = round_up(hit.t);
+                    }
+                }
+            }
+
+            for (int i = inner_count - 1; i >= 0; --i)
+                stack[stack_size++] = {node.child[inner[i]], t_enter[inner[i]]};
+        }
+
+        return hit_any;
+    }
+
+    // Stops at the first primitive found in ray_t, so children are neither sorted nor culled by distance
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        lane_ray lanes(r);
+        float t_min = round_down(ray_t.min);
+        float t_max = round_up(ray_t.max);
+
+        uint32_t stack[max_stack_size];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0)
+        {
+            const wide_bvh_node<N> &node = nodes[stack[--stack_size]];
+
+            alignas(32) float t_enter[N];
+            unsigned mask = intersect_children(node, lanes, t_min, t_max, t_enter);
+
+            while (mask)
+            {
+                int k = std::countr_zero(mask);
+                mask &= mask - 1;
+
+                if (node.count[k] == 0)
+                {
+                    stack[stack_size++] = node.child[k];
+                    continue;
+                }
+
+                for (uint32_t p = node.child[k]; p < node.child[k] + node.count[k]; ++p)
+                {
+                    if (primitive_ptrs[p]->occluded(r, ray_t))
+                        return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t node_count() const { return nodes.size(); }
+
+private:
+    // A wide node consumes at least one binary level, and every level pushes at most N - 1 siblings
+    static constexpr int max_stack_size = N * 64;
+
+    vector<shared_ptr<hittable>> primitives; // Owning, ordered by leaf
+    vector<const hittable *> primitive_ptrs;
+    vector<wide_bvh_node<N>> nodes;
+    aabb bbox;
+
+    // Ray broadcast into the lanes once per traversal
+    // As in flat_bvh, the origin is rounded towards each plane so that its slab can only grow
+    struct lane_ray
+    {
+        int sign[3];
+#if defined(WIDE_BVH_AVX)
+        __m256 origin_near8[3];
+        __m256 origin_far8[3];
+        __m256 inv_dir8[3];
+#endif
+#if defined(WIDE_BVH_SSE)
+        __m128 origin_near4[3];
+        __m128 origin_far4[3];
+        __m128 inv_dir4[3];
+#endif
+        float origin_near[3];
+        float origin_far[3];
+        float inv_dir[3];
+
+        lane_ray(const ray &r)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                sign[a] = r.sign(a);
+                origin_near[a] = sign[a] ? round_down(r.origin()[a]) : round_up(r.origin()[a]);
+                origin_far[a] = sign[a] ? round_up(r.origin()[a]) : round_down(r.origin()[a]);
+                inv_dir[a] = static_cast<float>(r.inv_direction()[a]);
+#if defined(WIDE_BVH_AVX)
+                origin_near8[a] = _mm256_set1_ps(origin_near[a]);
+                origin_far8[a] = _mm256_set1_ps(origin_far[a]);
+                inv_dir8[a] = _mm256_set1_ps(inv_dir[a]);
+#endif
+#if defined(WIDE_BVH_SSE)
+                origin_near4[a] = _mm_set1_ps(origin_near[a]);
+                origin_far4[a] = _mm_set1_ps(origin_far[a]);
+                inv_dir4[a] = _mm_set1_ps(inv_dir[a]);
+#endif
+            }
+        }
+    };
+
+    // Slab test of all N children, returns the hit mask and stores the entry distances
+    // max/min take the slab first, so a NaN slab keeps the running value as in aabb::hit
+    // The exit distances are padded by slab_exit_scale, see flat_bvh
+    static unsigned intersect_children(const wide_bvh_node<N> &node, const lane_ray &lanes, float t_min, float t_max, float *t_enter_out)
+    {
+#if defined(WIDE_BVH_AVX)
+        if constexpr (N == 8)
+        {
+            __m256 t_enter = _mm256_set1_ps(t_min);
+            __m256 t_exit = _mm256_set1_ps(t_max);
+            for (int a = 0; a < 3; ++a)
+            {
+                __m256 near_plane = _mm256_load_ps(lanes.sign[a] ? node.bounds_max[a] : node.bounds_min[a]);
+                __m256 far_plane = _mm256_load_ps(lanes.sign[a] ? node.bounds_min[a] : node.bounds_max[a]);
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(near_plane, lanes.origin_near8[a]), lanes.inv_dir8[a]);
+                __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(far_plane, lanes.origin_far8[a]), lanes.inv_dir8[a]);
+                t_enter = _mm256_max_ps(t0, t_enter);
+                t_exit = _mm256_min_ps(t1, t_exit);
+            }
+            t_exit = _mm256_mul_ps(t_exit, _mm256_set1_ps(slab_exit_scale));
+            _mm256_store_ps(t_enter_out, t_enter);
+            return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ)));
+        }
+#endif
+#if defined(WIDE_BVH_SSE)
+        if constexpr (N == 4)
+        {
+            __m128 t_enter = _mm_set1_ps(t_min);
+            __m128 t_exit = _mm_set1_ps(t_max);
+            for (int a = 0; a < 3; ++a)
+            {
+                __m128 near_plane = _mm_load_ps(lanes.sign[a] ? node.bounds_max[a] : node.bounds_min[a]);
+                __m128 far_plane = _mm_load_ps(lanes.sign[a] ? node.bounds_min[a] : node.bounds_max[a]);
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(near_plane, lanes.origin_near4[a]), lanes.inv_dir4[a]);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(far_plane, lanes.origin_far4[a]), lanes.inv_dir4[a]);
+                t_enter = _mm_max_ps(t0, t_enter);
+                t_exit = _mm_min_ps(t1, t_exit);
+            }
+            t_exit = _mm_mul_ps(t_exit, _mm_set1_ps(slab_exit_scale));
+            _mm_store_ps(t_enter_out, t_enter);
+            return static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit)));
+        }
+#endif
+        unsigned mask = 0;
+        for (int k = 0; k < N; ++k)
+        {
+            float t_enter = t_min;
+            float t_exit = t_max;
+            for (int a = 0; a < 3; ++a)
+            {
+                float t0 = ((lanes.sign[a] ? node.bounds_max[a][k] : node.bounds_min[a][k]) - lanes.origin_near[a]) * lanes.inv_dir[a];
+                float t1 = ((lanes.sign[a] ? node.bounds_min[a][k] : node.bounds_max[a][k]) - lanes.origin_far[a]) * lanes.inv_dir[a];
+                t_enter = t0 > t_enter ? t0 : t_enter;
+                t_exit = t1 < t_exit ? t1 : t_exit;
+            }
+            t_enter_out[k] = t_enter;
+            mask |= (t_enter <= t_exit * slab_exit_scale ? 1u : 0u) << k;
+        }
+        return mask;
+    }
+
+    static float surface_area(const flat_bvh_node &node)
+    {
+        float dx = node.bounds_max[0] - node.bounds_min[0];
+        float dy = node.bounds_max[1] - node.bounds_min[1];
+        float dz = node.bounds_max[2] - node.bounds_min[2];
+        return 2.0f * (dx * dy + dy * dz + dz * dx);
+    }
+
+    // Emit the wide node for the binary subtree at binary_index (depth-first), return its index
+    uint32_t collapse(const vector<flat_bvh_node> &binary_nodes, uint32_t binary_index)
+    {
+        // Open up the largest inner child until there are N children or only leaves are left
+        uint32_t children[N];
+        int child_count = 0;
+
+        const flat_bvh_node &root = binary_nodes[binary_index];
+        if (root.is_leaf())
+        {
+            children[child_count++] = binary_index;
+        }
+        else
+        {
+            children[child_count++] = binary_index + 1;
+            children[child_count++] = root.offset;
+        }
+
+        while (child_count < N)
+        {
+            int largest = -1;
+            float largest_area = -1;
+            for (int i = 0; i < child_count; ++i)
+            {
+                const flat_bvh_node &c = binary_nodes[children[i]];
+                if (!c.is_leaf() && surface_area(c) > largest_area)
+                {
+                    largest = i;
+                    largest_area = surface_area(c);
+                }
+            }
+
+            if (largest < 0)
+                break;
+
+            uint32_t opened = children[largest];
+            children[largest] = opened + 1;
+            children[child_count++] = binary_nodes[opened].offset;
+        }
+
+        uint32_t node_index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        for (int k = 0; k < N; ++k)
+        {
+            wide_bvh_node<N> &node = nodes[node_index];
+            if (k >= child_count)
+            {
+                for (int a = 0; a < 3; ++a)
+                {
+                    node.bounds_min[a][k] = std::numeric_limits<float>::infinity();
+                    node.bounds_max[a][k] = -std::numeric_limits<float>::infinity();
+                }
+                node.child[k] = wide_bvh_node<N>::empty;
+                node.count[k] = 0;
+                continue;
+            }
+
+            const flat_bvh_node &c = binary_nodes[children[k]];
+            for (int a = 0; a < 3; ++a)
+            {
+                node.bounds_min[a][k] = c.bounds_min[a];
+                node.bounds_max[a][k] = c.bounds_max[a];
+            }
+
+            if (c.is_leaf())
+            {
+                // Leaf sizes are copied as they are, flat_bvh bounds them by max_primitive_count
+                static_assert(std::numeric_limits<std::remove_extent_t<decltype(wide_bvh_node<N>::count)>>::max() >= flat_bvh_node::max_primitive_count,
+                              "wide_bvh_node::count must hold every flat_bvh leaf size");
+                node.child[k] = c.offset;
+                node.count[k] = c.primitive_count;
+            }
+            else
+            {
+                // nodes may grow while the child is collapsed, so the reference is taken again afterwards
+                uint32_t child_index = collapse(binary_nodes, children[k]);
+                nodes[node_index].child[k] = child_index;
+                nodes[node_index].count[k] = 0;
+            }
+        }
+
+        return node_index;
+    }
+};
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
+
+// Widest variant with SIMD box tests on the build target
+#if defined(WIDE_BVH_AVX)
+using native_wide_bvh = bvh8;
+#else
+using native_wide_bvh = bvh4;
+#endif
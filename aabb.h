@@ -46,29 +46,38 @@ public:
         return x;
     }
 
+    double surface_area() const
+    {
+        // Empty boxes have no area
+        if (x.size() < 0 || y.size() < 0 || z.size() < 0)
+            return 0;
+
+        return 2.0 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+    }
+
     bool hit(const ray &r, interval ray_t) const
-    // Andrew Kensler's optimized method
+    // Slab test on the inverse direction cached in the ray, its sign bits pick the near and far planes
     {
-        for (int a = 0; a < 3; ++a)
-        {
-            auto invD = 1.0 / r.direction()[a];
-            auto orig = r.origin()[a];
-
-            double t0 = (axis(a).min - orig) * invD;
-            double t1 = (axis(a).max - orig) * invD;
-
-            if (invD < 0)
-                std::swap(t0, t1);
-
-            if (t0 > ray_t.min)
-                ray_t.min = t0;
-            if (t1 < ray_t.max)
-                ray_t.max = t1;
-
-            if (ray_t.max <= ray_t.min)
-                return false;
-        }
-        return true;
+        const point3 &orig = r.origin();
+        const vec3 &inv_dir = r.inv_direction();
+
+        double tx0 = ((r.sign(0) ? x.max : x.min) - orig.x) * inv_dir.x;
+        double tx1 = ((r.sign(0) ? x.min : x.max) - orig.x) * inv_dir.x;
+        double ty0 = ((r.sign(1) ? y.max : y.min) - orig.y) * inv_dir.y;
+        double ty1 = ((r.sign(1) ? y.min : y.max) - orig.y) * inv_dir.y;
+        double tz0 = ((r.sign(2) ? z.max : z.min) - orig.z) * inv_dir.z;
+        double tz1 = ((r.sign(2) ? z.min : z.max) - orig.z) * inv_dir.z;
+
+        // Written so that a NaN slab (ray origin on a plane it is parallel to) leaves the interval untouched
+        double t_enter = tx0 > ray_t.min ? tx0 : ray_t.min;
+        t_enter = ty0 > t_enter ? ty0 : t_enter;
+        t_enter = tz0 > t_enter ? tz0 : t_enter;
+
+        double t_exit = tx1 < ray_t.max ? tx1 : ray_t.max;
+        t_exit = ty1 < t_exit ? ty1 : t_exit;
+        t_exit = tz1 < t_exit ? tz1 : t_exit;
+
+        return t_enter < t_exit;
     }
 };
 
@@ -3,20 +3,22 @@
 #include <atomic>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <functional>
-#include <future>
 #include <iostream>
-#include <queue>
+#include <mutex>
 #include <thread>
 #include <vector>
 
 #include "FrameBuffer.h"
 #include "PDF.h"
+#include "ScratchArena.h"
 #include "ThreadPool.h"
 #include "denoiser.h"
 #include "hittable_list.h"
 #include "material.h"
 #include "rtweekend.h"
+#include "sampler.h"
 
 using namespace std;
 class camera
@@ -24,8 +26,30 @@ class camera
 public:
     double aspect_ratio = 1.0;   // Ratio of image width over height
     int image_width = 1;         // Rendered image width in pixel count
-    int samplers_per_pixel = 16; // Amount of samplers for each pixel
+    int samplers_per_pixel = 16; // Amount of samplers for each pixel (the most any pixel takes with adaptive sampling)
     int max_depth = 20;          // Ray bounce limit
+    int rr_min_depth = 3;        // Bounces before Russian roulette may end a path
+
+    bool next_event_estimation = true; // Sample the lights with shadow rays at every bounce, combined with brdf sampling by MIS
+    sampler_type sampling = sampler_type::sobol; // Source of the pixel, lens, time and scattering sample values
+
+    // Adaptive sampling renders in passes, after the first one only the pixels that are still noisy get more samples
+    bool adaptive_sampling = false;
+    int adaptive_min_samples = 16;     // Samples every pixel takes before its error estimate is trusted
+    int adaptive_pass_samples = 16;    // Samples added per pass to each pixel that has not converged
+    double adaptive_threshold = 0.02;  // Standard error of the pixel's mean (tone mapped) luminance where it counts as converged
+
+    // Progressive rendering sweeps the whole frame a few samples at a time and keeps writing the image reached so far
+    bool progressive = false;
+    int progressive_pass_samples = 1;         // Samples added per pass to each pixel
+    int progressive_flush_passes = 0;         // Write progress.ppm every N passes (0 = never)
+    double progressive_flush_seconds = 10;    // Write progress.ppm once this many seconds passed since the last one (0 = never)
+    bool progressive_denoise_preview = false; // Also write a denoised progress_denoised.ppm with each flush
+
+    // Seconds of tracing after which the render stops with the samples it has (0 = no limit), implies progressive passes
+    // samplers_per_pixel still caps every pixel, so set it high to let the budget decide
+    double time_budget = 0;
+    int tile_size = 16;          // Edge length of the square screen tiles handed out to the workers
 
     double vfov = 90;                   // Vertical field of view
     point3 lookfrom = point3(0, 0, -1); // Point where camera is looking from
@@ -39,14 +63,20 @@ public:
     color background = color(0, 0, 0); // Scene background color (more like env light actually, could add HDRI or cube_map support someday)
 
     // Buffers
-    FrameBuffer<color> color_buffer;
+    FrameBuffer<color> color_buffer;   // Sum of the samples while rendering, per-pixel average afterwards
+    FrameBuffer<double> moment_buffer; // Sum of the squared sample luminance, for the variance estimate
+    FrameBuffer<int> sample_count_buffer;
     FrameBuffer<point3> position_buffer;
     FrameBuffer<vec3> normal_buffer;
     FrameBuffer<vec3> index_buffer;
 
     // Denoiser
-    Denoiser denoiser = Denoiser(4, 64, pool);
+    Denoiser denoiser;
 
+    camera(ThreadPool &_pool) : denoiser(4, 64, _pool), pool(_pool) {}
+
+    // lights is sampled for next event estimation, its surfaces must carry their emissive material
+    // Share them with world (as cornell_box does), a light without material adds nothing to the light samples
     void render(const hittable &world, const hittable &lights)
     {
         initialize();
@@ -54,61 +84,108 @@ public:
         // Timer
         auto start = chrono::steady_clock::now();
 
-        for (int j = 0; j < image_height; ++j)
+        int tiles_x = (image_width + tile_size - 1) / tile_size;
+        int tiles_y = (image_height + tile_size - 1) / tile_size;
+        int tile_count = tiles_x * tiles_y;
+
+        // A deadline can end the first pass early, so the indicator is stopped explicitly rather than waiting for every pixel
+        tracing_done = false;
+        thread thread_indicator(&camera::pixel_indicator, this, image_height * image_width);
+
+        // A time budget sweeps the frame progressively, so whatever is done at the deadline covers the whole image
+        bool sweep = progressive || time_budget > 0;
+        auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(time_budget));
+        auto out_of_time = [&]
+        { return time_budget > 0 && chrono::steady_clock::now() >= deadline; };
+
+        // Without adaptive sampling or progressive rendering the first pass takes every sample and is the only one
+        int pass_samples = sweep ? progressive_pass_samples : adaptive_sampling ? min(adaptive_min_samples, samplers_per_pixel) : samplers_per_pixel;
+        auto last_flush = start;
+
+        for (int pass = 0;; ++pass)
         {
-            for (int i = 0; i < image_width; ++i)
+            refined_pixels = 0;
+
+            // Past the deadline the remaining tiles of the pass are skipped, their pixels just have one pass less
+            pool.ParallelFor(0, tile_count, [&](size_t tile)
+                             {
+                                 if (!out_of_time())
+                                     render_tile(static_cast<int>(tile) % tiles_x, static_cast<int>(tile) / tiles_x, world, lights, pass_samples); });
+
+            if (refined_pixels == 0 || (!adaptive_sampling && !sweep))
+                break;
+
+            if (out_of_time())
             {
-                futures.push(pool.Submit([this, i, j, &world, &lights]
-                                         { render_pixel(i, j, world, lights, color_buffer.data); }));
+                clog << "\rTime budget of " << time_budget << "s reached after " << pass + 1 << " passes" << endl;
+                break;
             }
-        }
 
-        thread thread_indicator(&camera::pixel_indicator, this, image_height * image_width);
-        thread_indicator.detach();
+            clog << "\rPass " << pass + 1 << ": " << refined_pixels << " pixels refined" << endl;
+
+            // Intermediate image, written between passes while no worker touches the buffers
+            auto now = chrono::steady_clock::now();
+            bool flush_by_passes = progressive_flush_passes > 0 && (pass + 1) % progressive_flush_passes == 0;
+            bool flush_by_time = progressive_flush_seconds > 0 && chrono::duration<double>(now - last_flush).count() >= progressive_flush_seconds;
+            if (progressive && (flush_by_passes || flush_by_time))
+            {
+                flush_progress(world);
+                last_flush = now;
+            }
+
+            if (!sweep)
+                pass_samples = adaptive_pass_samples;
+        }
 
-        while (!futures.empty())
         {
-            futures.front().get();
-            futures.pop();
+            lock_guard<mutex> lock(indicator_mtx);
+            tracing_done = true;
         }
+        indicator_cv.notify_one();
+        thread_indicator.join();
 
         auto trace_end = chrono::steady_clock::now();
         auto tracing_time = chrono::duration_cast<chrono::seconds>(trace_end - start);
         clog << "\rTracing Completed. Tracing Time: " << tracing_time.count() << "s" << endl;
 
-        // PNG output
-        int comp = 3;
-        function<void(color, unsigned char *)> trans = [&](color c, unsigned char *p) -> void
-        {
-            for (int i = 0; i < comp; ++i)
-            {
-                int val = static_cast<int>(255.99 * (interval(0.000, 0.999)).clamp(Math::linear2gamma(c[i] / samplers_per_pixel)));
-                p[i] = static_cast<unsigned char>(val);
-            }
-            return;
-        };
+        long long total_samples = 0;
+        for (auto &row : sample_count_buffer.data)
+            for (int n : row)
+                total_samples += n;
+        clog << "Average Samplers per Pixel: " << double(total_samples) / (image_width * image_height) << endl;
+
+        resolve(color_buffer);
 
         // Denoise
-        std::clog << "Generating G-buffers..." << endl;
-        generate_Gbuffers(world);
-        std::clog << "G-buffers Generated." << endl;
+        if (!gbuffers_ready)
+        {
+            std::clog << "Generating G-buffers..." << endl;
+            generate_Gbuffers(world);
+            std::clog << "G-buffers Generated." << endl;
+        }
 
         // G-buffers output
-        rtw_image raw_image(color_buffer, comp, trans);
-        raw_image.saveasPPM("./raw.ppm");
-
-        rtw_image gbuffer_position(position_buffer, comp, trans);
-        gbuffer_position.saveasPPM("./position.ppm");
+        save_ppm(color_buffer, "./raw.ppm");
+        save_ppm(position_buffer, "./position.ppm");
+        save_ppm(normal_buffer, "./normal.ppm");
 
-        rtw_image gbuffer_normal(normal_buffer, comp, trans);
-        gbuffer_normal.saveasPPM("./normal.ppm");
+        // Sample density, white is samplers_per_pixel
+        if (adaptive_sampling)
+        {
+            function<void(int, unsigned char *)> density = [&](int n, unsigned char *p) -> void
+            {
+                for (int i = 0; i < 3; ++i)
+                    p[i] = static_cast<unsigned char>(255.99 * n / samplers_per_pixel);
+            };
+            rtw_image sample_density(sample_count_buffer, 3, density);
+            sample_density.saveasPPM("./samples.ppm");
+        }
 
         std::clog << "Denoising..." << endl;
         denoiser.denoise(color_buffer, position_buffer, normal_buffer, index_buffer);
         std::clog << "Denoising Completed." << endl;
 
-        rtw_image image(color_buffer, comp, trans);
-        image.saveasPPM("./result.ppm");
+        save_ppm(color_buffer, "./result.ppm");
 
         auto transfer_end = chrono::steady_clock::now();
         auto rendering_time = chrono::duration_cast<chrono::seconds>(transfer_end - start);
@@ -125,13 +202,17 @@ private:
     vec3 u, v, w;        // Camera frame basis vectors
     vec3 defocus_disk_u; // Defocus disk horizontal radius
     vec3 defocus_disk_v; // Defocus disk vertical radius
-    int sqrt_spp;        // Subpixel var for pixel sample stratifying
-    double stride_spp;   // Stride of subpixel stratifying
+
+    static constexpr double shadow_epsilon = 1e-4; // Relative distance kept off the light when testing shadow rays
 
     // Thread Pool
-    ThreadPool pool;
-    queue<future<void>> futures;
+    ThreadPool &pool;
     atomic<int> pixel_finished = 0;
+    mutex indicator_mtx;
+    condition_variable indicator_cv;
+    bool tracing_done = false; // Guarded by indicator_mtx
+    atomic<int> refined_pixels = 0; // Pixels that took samples in the current pass
+    bool gbuffers_ready = false;
 
     void initialize()
     {
@@ -168,12 +249,17 @@ private:
         defocus_disk_u = u * defocus_radius;
         defocus_disk_v = v * defocus_radius;
 
-        // Subpixel stratifying
-        sqrt_spp = static_cast<int>(sqrt(samplers_per_pixel));
-        stride_spp = 1.0 / sqrt_spp;
+        tile_size = (tile_size < 1) ? 1 : tile_size;
+        samplers_per_pixel = (samplers_per_pixel < 1) ? 1 : samplers_per_pixel;
+        progressive_pass_samples = (progressive_pass_samples < 1) ? 1 : progressive_pass_samples;
+        adaptive_min_samples = (adaptive_min_samples < 1) ? 1 : adaptive_min_samples;
+        adaptive_pass_samples = (adaptive_pass_samples < 1) ? 1 : adaptive_pass_samples;
+        gbuffers_ready = false;
 
         // Buffers
         color_buffer = FrameBuffer<color>(image_width, image_height, color(0, 0, 0));
+        moment_buffer = FrameBuffer<double>(image_width, image_height, 0.0);
+        sample_count_buffer = FrameBuffer<int>(image_width, image_height, 0);
         position_buffer = FrameBuffer<point3>(image_width, image_height, point3(0, 0, 0), [](const point3 &a, const point3 &b) -> double
                                               { return Math::Vector::distance(a, b) / 100; });
         normal_buffer = FrameBuffer<vec3>(image_width, image_height, vec3(0, 0, 0), [](const vec3 &a, const vec3 &b) -> double
@@ -182,138 +268,327 @@ private:
                                          { return (a.x == b.x && a.y == b.y) ? 0 : 100.0; });
     }
 
-    // Return a random offset in the square around pixel, given two sub-pixel indexes
-    vec3 pixel_sample_square(int sub_i, int sub_j) const
+    // Return an offset in the square around pixel, the sampler spreads the offsets of a pixel's samples over it
+    vec3 pixel_sample_square(const vec2d &u) const
     {
-        auto px = -0.5 + stride_spp * (sub_i + random_double());
-        auto py = -0.5 + stride_spp * (sub_j + random_double());
+        auto px = -0.5 + u.x;
+        auto py = -0.5 + u.y;
 
         return (px * pixel_delta_u) + (py * pixel_delta_v);
     }
 
-    // Return a random point in the camera defocus disk
-    point3 defocus_disk_sample() const
+    // Return a point in the camera defocus disk, uniform over its area
+    point3 defocus_disk_sample(const vec2d &u) const
     {
-        auto p = random_disk();
-        return center + p[0] * defocus_disk_u + p[1] * defocus_disk_v;
+        auto r = sqrt(u.x);
+        auto phi = 2 * Math::M_PI * u.y;
+        return center + (r * cos(phi)) * defocus_disk_u + (r * sin(phi)) * defocus_disk_v;
     }
 
-    // Return a randomly sampled ray for pixel i, j and given subpixel indexes, originating from the camera defocus disk
-    ray get_primary_ray(int i, int j, int sub_i = 0, int sub_j = 0) const
+    // Return a sampled ray for pixel i, j, originating from the camera defocus disk
+    ray get_primary_ray(int i, int j, sampler &smp) const
     {
         auto pixel_center = pixel00_pos + (j * pixel_delta_u) + (i * pixel_delta_v);
-        auto pixel_sample = pixel_center + ((sub_i == 0 && sub_j == 0) ? vec3(0, 0, 0) : pixel_sample_square(sub_i, sub_j));
+        auto pixel_sample = pixel_center + pixel_sample_square(smp.get_2d());
 
-        auto ray_origin = defocus_angle <= 0 ? center : defocus_disk_sample();
+        auto lens_sample = smp.get_2d();
+        auto ray_origin = defocus_angle <= 0 ? center : defocus_disk_sample(lens_sample);
 
         auto ray_direction = pixel_sample - ray_origin;
 
         // Launch rays in a shutter opening duration
-        double ray_time = random_double(0, frame_duration);
+        double ray_time = smp.get_1d() * frame_duration;
         return ray(ray_origin, ray_direction, ray_time);
     }
 
-    color ray_color(const ray &r, const hittable &world, int current_depth, const hittable &lights) const
+    // Return the ray through the center of pixel i, j from the camera center, used for the G-buffers
+    ray get_center_ray(int i, int j) const
+    {
+        auto pixel_center = pixel00_pos + (j * pixel_delta_u) + (i * pixel_delta_v);
+        return ray(center, pixel_center - center, 0);
+    }
+
+    // Iterative path tracer, the path throughput carries the product of scatter_color / pdf along the bounces
+    color ray_color(const ray &r, const hittable &world, const hittable &lights, sampler &smp) const
     {
-        hit_info hit;
+        color radiance(0, 0, 0);
+        color throughput(1, 1, 1);
+        ray current = r;
+
+        // Brdf pdf of the direction that led to the current hit, 0 for camera rays (no light sample to compete with)
+        double prev_brdf_pdf = 0;
+        point3 prev_point;
 
-        // Simply address the floating point error on intersection by ignoring intersecting point which is close enough to surfaces
-        if (world.hit(r, interval(0.001, infinity), hit))
+        for (int depth = 0; depth < max_depth; ++depth)
         {
-            --current_depth;
-            if (current_depth > 0)
+            hit_info hit;
+
+            // Simply address the floating point error on intersection by ignoring intersecting point which is close enough to surfaces
+            // If ray hits nothing, simply add background color
+            if (!world.hit(current, interval(0.001, infinity), hit))
+            {
+                radiance += throughput * background;
+                break;
+            }
+
+            // The hit at the bounce limit contributes nothing
+            if (depth == max_depth - 1)
+                break;
+
+            color emission_color = hit.mat->emitter(current, hit, hit.u, hit.v, hit.hit_point);
+            if (next_event_estimation && prev_brdf_pdf > 0)
             {
-                color emission_color = hit.mat->emitter(r, hit, hit.u, hit.v, hit.hit_point);
-                scatter_info sinfo;
+                // The light sample of the previous vertex could have found this emission too
+                double light_pdf = lights.pdf_value(prev_point, current.direction());
+                emission_color *= power_heuristic(prev_brdf_pdf, light_pdf);
+            }
+            radiance += throughput * emission_color;
 
-                if (!hit.mat->scatter(r, hit, sinfo))
-                    return emission_color;
+            scatter_info sinfo;
+            if (!hit.mat->scatter(current, hit, sinfo))
+                break;
 
-                // if pdf is not available, use specific ray as important ray
+            ray scattered;
+            double pdf_val;
 
-                // TODO:: need create a new branch for light sampling (Shadow Ray, Direct Lighting, etc.)
-                
-                auto light_pdf = make_shared<hittable_pdf>(lights, hit.hit_point);
-                mixture_pdf mixed_pdf(vector<double>{0.25, 0.75}, light_pdf, sinfo.brdf_pdf);
+            if (next_event_estimation)
+            {
+                // The hit of the last vertex is dropped by the bounce limit, so the light sample takes the whole weight there
+                bool last_vertex = depth + 2 >= max_depth;
+                radiance += throughput * sample_direct_light(current, hit, sinfo, world, lights, smp.get_2d(), last_vertex);
 
-                ray scattered = ray(hit.hit_point, mixed_pdf.generate(), r.time());
-                auto pdf_val = mixed_pdf.value(scattered.direction());
+                scattered = ray(hit.hit_point, sinfo.brdf_pdf->generate(smp.get_2d()), current.time());
+                pdf_val = sinfo.brdf_pdf->value(scattered.direction());
 
-                // Debug
-                // ray scattered = ray(hit.hit_point, sinfo.brdf_pdf->generate(), r.time());
-                // auto pdf_val = sinfo.brdf_pdf->value(scattered.direction());
+                prev_brdf_pdf = pdf_val;
+                prev_point = hit.hit_point;
+            }
+            else
+            {
+                static_mixture_pdf mixed_pdf({0.25, 0.75}, hittable_pdf(lights, hit.hit_point), sinfo.brdf_pdf);
 
-                // double scattering_pdf = hit.mat->scattering_pdf(r, hit, scattered);
-                color scatter_color = hit.mat->scatter_color(r, hit, scattered);
-                color incoming_color = ray_color(scattered, world, current_depth, lights);
-                scatter_color = (scatter_color * incoming_color) / pdf_val;
+                scattered = ray(hit.hit_point, mixed_pdf.generate(smp.get_2d()), current.time());
+                pdf_val = mixed_pdf.value(scattered.direction());
+            }
+
+            if (pdf_val <= 0)
+                break;
 
-                color result = emission_color + scatter_color;
+            throughput *= hit.mat->scatter_color(current, hit, scattered) / pdf_val;
 
-                // Tone mapping
-                color x = max(color(0), result - color(0.004));
-                return (x * (6.2 * x + 0.5)) / (x * (6.2 * x + 1.7) + 0.06);
+            // Russian roulette, paths that can only add little are ended, the survivors are weighted up to stay unbiased
+            if (depth + 1 >= rr_min_depth)
+            {
+                double survival = fmin(fmax(throughput.x, fmax(throughput.y, throughput.z)), 0.95);
+                if (smp.get_1d() >= survival)
+                    break;
+                throughput /= survival;
             }
 
-            return color(0, 0, 0);
+            current = scattered;
         }
-        // If ray hits nothing, simply return background color
-        else
+
+        // Tone mapping
+        color x = max(color(0), radiance - color(0.004));
+        return (x * (6.2 * x + 0.5)) / (x * (6.2 * x + 1.7) + 0.06);
+    }
+
+    // Shadow ray towards a point sampled on the lights, weighted against brdf sampling by the power heuristic
+    color sample_direct_light(const ray &r_in, const hit_info &hit, const scatter_info &sinfo, const hittable &world, const hittable &lights, const vec2d &u, bool last_vertex) const
+    {
+        ray shadow_ray(hit.hit_point, lights.random(hit.hit_point, u), r_in.time());
+
+        // Light behind the shading surface
+        if (dot(shadow_ray.direction(), hit.normal) <= 0)
+            return color(0, 0, 0);
+
+        double light_pdf = lights.pdf_value(hit.hit_point, shadow_ray.direction());
+        if (light_pdf <= 0)
+            return color(0, 0, 0);
+
+        // Lights carry their emissive material, the world is only asked whether anything lies in between
+        hit_info light_hit;
+        if (!lights.hit(shadow_ray, interval(0.001, infinity), light_hit) || light_hit.mat == nullptr)
+            return color(0, 0, 0);
+
+        if (world.occluded(shadow_ray, interval(0.001, light_hit.t * (1 - shadow_epsilon))))
+            return color(0, 0, 0);
+
+        color emission_color = light_hit.mat->emitter(shadow_ray, light_hit, light_hit.u, light_hit.v, light_hit.hit_point);
+        color scatter_color = hit.mat->scatter_color(r_in, hit, shadow_ray);
+
+        double weight = last_vertex ? 1.0 : power_heuristic(light_pdf, sinfo.brdf_pdf->value(shadow_ray.direction()));
+        return scatter_color * emission_color * weight / light_pdf;
+    }
+
+    // Power heuristic with beta = 2 (Veach), weight of the strategy with pdf a against the one with pdf b
+    static double power_heuristic(double a, double b)
+    {
+        double a2 = a * a;
+        double b2 = b * b;
+        return a2 + b2 > 0 ? a2 / (a2 + b2) : 0;
+    }
+
+    // Render the pixels of the tile at (tile_x, tile_y) in tile units that still need samples, adding up to pass_samples each
+    void render_tile(int tile_x, int tile_y, const hittable &world, const hittable &lights, int pass_samples)
+    {
+        int row_begin = tile_y * tile_size;
+        int row_end = min(row_begin + tile_size, image_height);
+        int col_begin = tile_x * tile_size;
+        int col_end = min(col_begin + tile_size, image_width);
+        int refined = 0;
+
+        for (int i = row_begin; i < row_end; ++i)
         {
-            return background;
+            for (int j = col_begin; j < col_end; ++j)
+            {
+                int taken = sample_count_buffer.data[i][j];
+                if (taken > 0 && pixel_converged(i, j))
+                    continue;
+
+                // Only pixels that actually take samples keep the pass loop going
+                int count = min(pass_samples, samplers_per_pixel - taken);
+                if (count <= 0)
+                    continue;
+
+                render_pixel(i, j, taken, count, world, lights);
+                ++refined;
+            }
         }
+
+        refined_pixels += refined;
+        pixel_finished += (row_end - row_begin) * (col_end - col_begin);
     }
 
-    void render_pixel(int i, int j, const hittable &world, const hittable &lights, vector<vector<color>> &buffer)
+    // Render samples [first_sample, first_sample + count) of the pixel at row i, column j, accumulating into the buffers
+    void render_pixel(int i, int j, int first_sample, int count, const hittable &world, const hittable &lights)
     {
         color pixel_color(0, 0, 0);
+        double pixel_moment = 0;
+
+        independent_sampler independent;
+        sobol_sampler sobol;
+        sampler &smp = sampling == sampler_type::sobol ? static_cast<sampler &>(sobol) : independent;
+
+        uint64_t pixel_index = uint64_t(i) * image_width + j;
 
-        for (int s_i = 0; s_i < sqrt_spp; ++s_i)
+        // Samples are taken in sequence order, any prefix of the sequence is well spread, so any count works
+        for (uint32_t sample_index = first_sample; sample_index < uint32_t(first_sample + count); ++sample_index)
         {
-            for (int s_j = 0; s_j < sqrt_spp; ++s_j)
-            {
-                ray r = get_primary_ray(i, j, s_i, s_j);
-                pixel_color += ray_color(r, world, max_depth, lights);
-            }
+            // Sampling objects of the previous path are no longer referenced
+            ScratchArena::Local().Reset();
+
+            // Every pixel sample owns its random sequence, so the image does not depend on which thread renders it
+            Math::seed_random((pixel_index << 32) | sample_index);
+            smp.start_pixel_sample(pixel_index, sample_index);
+
+            ray r = get_primary_ray(i, j, smp);
+            color sample_color = ray_color(r, world, lights, smp);
+
+            pixel_color += sample_color;
+            pixel_moment += luminance(sample_color) * luminance(sample_color);
         }
 
         // Write all color into buffer
-        buffer[i][j] = pixel_color;
-        ++pixel_finished;
+        color_buffer.data[i][j] += pixel_color;
+        moment_buffer.data[i][j] += pixel_moment;
+        sample_count_buffer.data[i][j] += count;
     }
 
+    // A pixel is done once it used up samplers_per_pixel, or (adaptive sampling) once its mean luminance is known well enough
+    bool pixel_converged(int i, int j) const
+    {
+        int n = sample_count_buffer.data[i][j];
+        if (n >= samplers_per_pixel || !adaptive_sampling)
+            return n >= samplers_per_pixel;
+        if (n < max(2, adaptive_min_samples))
+            return false;
+
+        double mean = luminance(color_buffer.data[i][j]) / n;
+        double variance = fmax(0.0, moment_buffer.data[i][j] / n - mean * mean) * n / (n - 1);
+
+        return sqrt(variance / n) < adaptive_threshold;
+    }
+
+    // Turn sample sums into per-pixel averages, pixels may have taken different numbers of samples
+    void resolve(FrameBuffer<color> &sums)
+    {
+        pool.ParallelFor2D(image_height, image_width, [&](size_t i, size_t j)
+                           {
+                               int n = sample_count_buffer.data[i][j];
+                               sums.data[i][j] /= (n > 0 ? n : 1); });
+    }
+
+    // Write the image reached so far, the accumulation buffers are left untouched
+    void flush_progress(const hittable &world)
+    {
+        FrameBuffer<color> preview = color_buffer;
+        resolve(preview);
+        save_ppm(preview, "./progress.ppm");
+
+        if (progressive_denoise_preview)
+        {
+            if (!gbuffers_ready)
+                generate_Gbuffers(world);
+
+            denoiser.denoise(preview, position_buffer, normal_buffer, index_buffer);
+            save_ppm(preview, "./progress_denoised.ppm");
+        }
+
+        clog << "\rProgress written" << endl;
+    }
+
+    // Gamma corrected PPM output
+    template <typename T>
+    static void save_ppm(const FrameBuffer<T> &fb, const char *path)
+    {
+        function<void(T, unsigned char *)> trans = [](T c, unsigned char *p) -> void
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                int val = static_cast<int>(255.99 * (interval(0.000, 0.999)).clamp(Math::linear2gamma(c[i])));
+                p[i] = static_cast<unsigned char>(val);
+            }
+        };
+
+        rtw_image image(fb, 3, trans);
+        image.saveasPPM(path);
+    }
+
+    static double luminance(const color &c) { return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z; }
+
     // Indicator for pixel rendering progress
     void pixel_indicator(int total_pixels)
     {
-        while (pixel_finished < total_pixels)
+        unique_lock<mutex> lock(indicator_mtx);
+        while (!tracing_done && pixel_finished < total_pixels)
         {
             clog << "\rPixels Rendered: " << pixel_finished << " / " << total_pixels << flush;
-            this_thread::sleep_for(chrono::milliseconds(500));
+            indicator_cv.wait_for(lock, chrono::milliseconds(500), [this]
+                                  { return tracing_done; });
         }
     }
 
     // Generate G-buffers for denoising
     void generate_Gbuffers(const hittable &world)
     {
-        for (int j = 0; j < image_height; ++j)
-        {
-            for (int i = 0; i < image_width; ++i)
-            {
-                ray primary_ray = get_primary_ray(i, j);
-                hit_info hit;
-                if (world.hit(primary_ray, interval(0.001, infinity), hit))
-                {
-                    position_buffer.data[i][j] = hit.hit_point;
-                    normal_buffer.data[i][j] = hit.normal;
-                    index_buffer.data[i][j] = vec3(hit.mat->index, hit.hittable_index, 0);
-                }
-                else
-                {
-                    position_buffer.data[i][j] = vec3(0, 0, 0);
-                    normal_buffer.data[i][j] = vec3(0, 0, 0);
-                    index_buffer.data[i][j] = vec3(0, 0, 0);
-                }
-            }
-        }
+        pool.ParallelFor2D(image_height, image_width, [&](size_t i, size_t j)
+                           {
+                               ray primary_ray = get_center_ray(static_cast<int>(i), static_cast<int>(j));
+                               hit_info hit;
+                               if (world.hit(primary_ray, interval(0.001, infinity), hit))
+                               {
+                                   position_buffer.data[i][j] = hit.hit_point;
+                                   normal_buffer.data[i][j] = hit.normal;
+                                   index_buffer.data[i][j] = vec3(hit.mat->index, hit.hittable_index, 0);
+                               }
+                               else
+                               {
+                                   position_buffer.data[i][j] = vec3(0, 0, 0);
+                                   normal_buffer.data[i][j] = vec3(0, 0, 0);
+                                   index_buffer.data[i][j] = vec3(0, 0, 0);
+                               } });
+
+        gbuffers_ready = true;
     }
 };
\ No newline at end of file
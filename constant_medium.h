@@ -13,13 +13,22 @@ public:
     constant_medium(shared_ptr<hittable> b, double d, color c) : boundary(b), neg_inv_density(-1.0 / d), phase_function(make_shared<isotropic>(c)) {}
 
     bool hit(const ray &r, interval ray_t, hit_info &hit) const override
+    {
+        if (!intersect(r, ray_t, hit))
+            return false;
+
+        surface_interaction(r, hit);
+        return true;
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_info &hit) const override
     {
         hit_info hit_in, hit_out;
 
-        // Query hits through the boundary
-        if (!boundary->hit(r, universe, hit_in))
+        // Query hits through the boundary, only the distances are needed
+        if (!boundary->intersect(r, universe, hit_in))
             return false;
-        if (!boundary->hit(r, interval(hit_in.t + 1e-4, infinity), hit_out))
+        if (!boundary->intersect(r, interval(hit_in.t + 1e-4, infinity), hit_out))
             return false;
 
         // debug info waiting to be implemented
@@ -46,13 +55,18 @@ public:
         
         // Scatting confirmed
         hit.t = hit_in.t + dist_inside_boundary / length(r.direction());
+        hit.object = this;
+
+        return true;
+    }
+
+    void surface_interaction(const ray &r, hit_info &hit) const override
+    {
         hit.hit_point = r.at(hit.t);
 
         hit.normal = vec3(1, 0, 0); // arbitrary
         hit.front_face = true;      // also arbitrary
-        hit.mat = phase_function;
-
-        return true;
+        hit.mat = phase_function.get();
     }
 
     aabb bounding_box() const override
@@ -4,8 +4,6 @@
 #include "color.h"
 #include "ThreadPool.h"
 #include <cmath>
-#include <future>
-#include <queue>
 
 class Denoiser
 {
@@ -17,47 +15,41 @@ public:
     {
         FrameBuffer<color> result = src_color;
 
-        for (int i = 0; i < src_color.height; ++i)
-        {
-            for (int j = 0; j < src_color.width; ++j)
-            {
-                futures.push(pool.Submit([&](int i, int j)
-                {
-                    // For each pixel, search its neighbors and use it to weight the denoising
-                    double weight_sum = 0;
+        pool.ParallelFor2D(src_color.height, src_color.width, [&](size_t row, size_t col)
+                           {
+                               int i = static_cast<int>(row);
+                               int j = static_cast<int>(col);
 
-                    for (int s = 0; s < samplers; ++s)
-                    {
-                        vec2d offsets = Math::Vector::random_disk(kernal_radius);
-                        vec2i coords = vec2d(i, j) + offsets + 0.5;
+                               // For each pixel, search its neighbors and use it to weight the denoising
+                               double weight_sum = 0;
 
-                        if (coords.x >= 0 && coords.x < src_color.height && coords.y >= 0 && coords.y < src_color.width)
-                        {
-                            if (i == coords.x && j == coords.y)
-                            {
-                                continue;
-                            }
+                               // Each pixel draws its own kernel offsets, so the result does not depend on which thread ran it
+                               // Stream 1 keeps them apart from the render's per-sample sequences
+                               Math::seed_random(((uint64_t(row) * src_color.width + col) << 32) | 0xD3A0u, 1);
 
-                            // Use the G-buffers to weight the denoising
-                            double weight = 0;
-                            (..., (weight += buffers.diff(buffers.data[i][j], buffers.data[coords.x][coords.y])));
-                            weight = std::exp(-weight);
+                               for (int s = 0; s < samplers; ++s)
+                               {
+                                   vec2d offsets = Math::Vector::random_disk(kernal_radius);
+                                   vec2i coords = vec2d(i, j) + offsets + 0.5;
 
-                            weight_sum += weight;
+                                   if (coords.x >= 0 && coords.x < src_color.height && coords.y >= 0 && coords.y < src_color.width)
+                                   {
+                                       if (i == coords.x && j == coords.y)
+                                       {
+                                           continue;
+                                       }
 
-                            result.data[i][j] += weight * src_color.data[coords.x][coords.y];
-                        }
-                    }
-                    result.data[i][j] /= weight_sum;
-                }, i, j));
-            }
-        }
+                                       // Use the G-buffers to weight the denoising
+                                       double weight = 0;
+                                       (..., (weight += buffers.diff(buffers.data[i][j], buffers.data[coords.x][coords.y])));
+                                       weight = std::exp(-weight);
 
-        while (!futures.empty())
-        {
-            futures.front().get();
-            futures.pop();
-        }
+                                       weight_sum += weight;
+
+                                       result.data[i][j] += weight * src_color.data[coords.x][coords.y];
+                                   }
+                               }
+                               result.data[i][j] /= weight_sum; });
 
         src_color = result;
     }
@@ -66,5 +58,4 @@ private:
     double kernal_radius;
     int samplers;
     ThreadPool &pool;
-    std::queue<std::future<void>> futures;
 };
\ No newline at end of file
@@ -7,13 +7,15 @@
 
 
 class material;
+class hittable;
 
 class hit_info
 {
 public:
     point3 hit_point;
     vec3 normal;
-    shared_ptr<material> mat;
+    const material *mat; // Non-owning, the hittables keep the materials alive
+    const hittable *object; // Primitive that still has to fill in the surface details, see hittable::intersect
     unsigned int hittable_index; // For debugging and denoising
     double t;
     double u;
@@ -36,11 +38,42 @@ public:
 
     hittable() { ++index; }
     virtual ~hittable() = default;
+    // hit is only written to when true is returned
     virtual bool hit(const ray &r, interval ray_t, hit_info &hit) const = 0;
     virtual aabb bounding_box() const = 0;
 
+    // Closest-hit search that leaves out the surface details: primitives only write t, object and what they need later,
+    // complete() then fills in the rest once for the primitive that won
+    // Objects transforming the ray (translate, rotate_y) finish their surface right away and leave object null
+    virtual bool intersect(const ray &r, interval ray_t, hit_info &hit) const
+    {
+        if (!this->hit(r, ray_t, hit))
+            return false;
+
+        hit.object = nullptr;
+        return true;
+    }
+
+    // Fill hit_point, normal, uv and material of a record this object reported through intersect
+    virtual void surface_interaction(const ray &r, hit_info &hit) const {}
+
+    // Any-hit query for shadow rays and visibility: true as soon as anything is found in ray_t, no record is produced
+    virtual bool occluded(const ray &r, interval ray_t) const
+    {
+        hit_info hit;
+        return intersect(r, ray_t, hit);
+    }
+
+    // Finish a record found by intersect, r has to be the ray it was found with
+    static void complete(const ray &r, hit_info &hit)
+    {
+        if (hit.object)
+            hit.object->surface_interaction(r, hit);
+    }
+
     virtual double pdf_value(const point3 &origin, const vec3 &v) const { return 0.0; }
-    virtual vec3 random(const vec3 &origin) const { return vec3(1, 0, 0); }
+    // Direction from origin towards a point on the object, driven by a 2D sample u in [0, 1)^2
+    virtual vec3 random(const vec3 &origin, const vec2d &u) const { return vec3(1, 0, 0); }
 };
 
 unsigned int hittable::index = 1; // 0 is reserved for the background
@@ -67,6 +100,11 @@ public:
         return true;
     }
 
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return object->occluded(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+    }
+
     aabb bounding_box() const override { return bbox; }
 
 private:
@@ -113,17 +151,7 @@ public:
 
     bool hit(const ray &r, interval ray_t, hit_info &hit) const override
     {
-        // Translate the ray into object space
-        auto origin = r.origin();
-        auto direction = r.direction();
-
-        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
-
-        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-
-        ray rotated(origin, direction, r.time());
+        ray rotated = to_object_space(r);
 
         // Any hits in object space?
         if (!object->hit(rotated, ray_t, hit))
@@ -145,6 +173,11 @@ public:
         return true;
     }
 
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return object->occluded(to_object_space(r), ray_t);
+    }
+
     aabb bounding_box() const override { return bbox; }
 
 private:
@@ -152,4 +185,19 @@ private:
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    // Translate the ray into object space
+    ray to_object_space(const ray &r) const
+    {
+        auto origin = r.origin();
+        auto direction = r.direction();
+
+        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
+        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+
+        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+
+        return ray(origin, direction, r.time());
+    }
 };
\ No newline at end of file
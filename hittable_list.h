@@ -43,23 +43,42 @@ public:
 
     bool hit(const ray &r, interval ray_t, hit_info &hit) const override
     {
-        hit_info tmp;
+        if (!intersect(r, ray_t, hit))
+            return false;
+
+        complete(r, hit);
+        return true;
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_info &hit) const override
+    {
         bool hit_any = false;
         auto closest_so_far = ray_t.max;
 
+        // Objects only write hit when they report a closer hit, so no temporary record is needed
         for (const auto &object : objects)
         {
-            if (object->hit(r, interval(ray_t.min, closest_so_far), tmp))
+            if (object->intersect(r, interval(ray_t.min, closest_so_far), hit))
             {
                 hit_any = true;
-                closest_so_far = tmp.t;
-                hit = tmp;
+                closest_so_far = hit.t;
             }
         }
 
         return hit_any;
     }
 
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        for (const auto &object : objects)
+        {
+            if (object->occluded(r, ray_t))
+                return true;
+        }
+
+        return false;
+    }
+
     double pdf_value(const point3 &origin, const vec3 &v) const override
     {
         if (!objects.empty())
@@ -67,12 +86,12 @@ public:
 
         return hittable::pdf_value(origin, v);
     }
-    vec3 random(const vec3 &origin) const override
+    vec3 random(const vec3 &origin, const vec2d &u) const override
     {
         if (!objects.empty())
-            return objects[0]->random(origin);
+            return objects[0]->random(origin, u);
 
-        return hittable::random(origin);
+        return hittable::random(origin, u);
     }
 
 private:
@@ -1,24 +1,97 @@
 #include "rtweekend.h"
 #include "camera.h"
 #include "BVH.h"
+#include "WideBVH.h"
 #include "scenelib.h"
 
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include <string>
+
+void print_usage()
+{
+    cerr << "Usage: RayTracing [--time <duration>] [samplers]" << '\n'
+         << "  duration is a number of seconds, optionally suffixed with s, m or h (120, 120s, 2m, 1h)" << '\n';
+}
+
+// Seconds from "120", "120s", "2m" or "1h", prints the usage and exits on anything else
+double parse_duration(const string &text)
+{
+    size_t end = 0;
+    double value = 0;
+    try
+    {
+        value = stod(text, &end);
+    }
+    catch (const exception &)
+    {
+        end = 0;
+    }
+
+    string unit = text.substr(end);
+    double scale = 0;
+    if (unit.empty() || unit == "s")
+        scale = 1;
+    else if (unit == "m")
+        scale = 60;
+    else if (unit == "h")
+        scale = 3600;
+
+    if (end == 0 || scale == 0 || !isfinite(value) || value <= 0)
+    {
+        cerr << "Invalid duration: " << text << '\n';
+        print_usage();
+        exit(1);
+    }
+    return value * scale;
+}
 
 int main(int argc, char const *argv[])
 {
+    int samplers = 0;
+    double time_budget = 0;
+    for (int a = 1; a < argc; ++a)
+    {
+        string arg = argv[a];
+        if (arg == "--time")
+        {
+            if (a + 1 == argc)
+            {
+                print_usage();
+                return 1;
+            }
+            time_budget = parse_duration(argv[++a]);
+        }
+        else
+            samplers = atoi(argv[a]);
+    }
+
+    // With a time budget the budget decides, unless a sample count is given as well
+    if (samplers <= 0)
+        samplers = time_budget > 0 ? 1 << 16 : 8;
+
     hittable_list world;
     hittable_list lights;
     SceneFunc(world, lights);
 
+    ThreadPool pool;
+
     // Building acceleration structure(BVH Tree)
-    world = hittable_list(make_shared<bvh_node>(world));
+    // bvh_build_method::lbvh builds much faster at some cost in traversal speed, good for previews
+    // native_wide_bvh collapses the binary tree into 8 (AVX) or 4 (SSE) wide nodes, flat_bvh keeps it binary
+    auto build_start = chrono::steady_clock::now();
+    world = hittable_list(make_shared<native_wide_bvh>(world, pool, bvh_build_method::sah));
+    auto build_time = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - build_start);
+    clog << "BVH Build Time: " << build_time.count() << "ms" << '\n';
 
-    camera cam;
+    camera cam(pool);
 
     cam.aspect_ratio = 1.0;
     cam.image_width = 800;
-    cam.samplers_per_pixel = argc > 1 ? atoi(argv[argc - 1]) : 8; // samplers
+    cam.samplers_per_pixel = samplers;
+    cam.time_budget = time_budget;
     cam.max_depth = 8;
 
     cam.vfov = 40;
@@ -30,6 +103,8 @@ int main(int argc, char const *argv[])
     // cam.focus_dist = 10.0;
     // cam.frame_duration = 1.0;
     clog << "Samplers: " << cam.samplers_per_pixel << '\n';
+    if (cam.time_budget > 0)
+        clog << "Time Budget: " << cam.time_budget << "s" << '\n';
 
     cam.render(world, lights);
 
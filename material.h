@@ -2,6 +2,7 @@
 
 #include "BRDF.h"
 #include "PDF.h"
+#include "ScratchArena.h"
 #include "rtweekend.h"
 #include "texture.h"
 #include <iostream>
@@ -11,7 +12,7 @@ class scatter_info
 {
 public:
     BRDFInfo brdf_info;
-    std::shared_ptr<pdf> brdf_pdf;
+    const pdf *brdf_pdf; // Lives in the thread's ScratchArena until the next sample path
     bool no_pdf;
     ray ray_without_pdf;
 };
@@ -55,11 +56,11 @@ public:
         sinfo.brdf_info.metallic = metallic;
 
         // for Disney BRDF, we use GGX for NDC
-        // sinfo.brdf_pdf = make_shared<GGX_pdf>(hit.normal, roughness);
+        // sinfo.brdf_pdf = ScratchArena::Local().Create<GGX_pdf>(hit.normal, roughness);
         // sinfo.no_pdf = false;
 
         // use uniform sampling for testing
-        sinfo.brdf_pdf = make_shared<cosine_hemisphere_pdf>(hit.normal);
+        sinfo.brdf_pdf = ScratchArena::Local().Create<cosine_hemisphere_pdf>(hit.normal);
         sinfo.no_pdf = true;
 
         return true;
@@ -41,6 +41,16 @@ public:
     }
 
     bool hit(const ray &r, interval ray_t, hit_info &hit) const override
+    {
+        if (!intersect(r, ray_t, hit))
+            return false;
+
+        surface_interaction(r, hit);
+        return true;
+    }
+
+    // UV falls out of the interior test anyway, the rest waits for surface_interaction
+    bool intersect(const ray &r, interval ray_t, hit_info &hit) const override
     {
         auto denom = dot(normal, r.direction());
 
@@ -62,31 +72,37 @@ public:
         if (!is_interior(alpha, beta, hit))
             return false;
 
-        // Hit confirm, fill the hit_info
+        // Hit confirm, the rest of hit_info is filled once this turns out to be the closest hit
         hit.hittable_index = index;
         hit.t = t;
-        hit.hit_point = p;
-        hit.mat = mat;
-        hit.set_face_normal(r, normal);
+        hit.object = this;
 
         return true;
     }
 
+    void surface_interaction(const ray &r, hit_info &hit) const override
+    {
+        hit.hit_point = r.at(hit.t);
+        hit.mat = mat.get();
+        hit.set_face_normal(r, normal);
+    }
+
     double pdf_value(const point3 &origin, const vec3 &v) const override
     {
+        // Only the distance is needed, the face normal would just flip the sign
         hit_info hit;
-        if (!this->hit(ray(origin, v), interval(0.001, infinity), hit))
+        if (!intersect(ray(origin, v), interval(0.001, infinity), hit))
             return 0;
 
         auto distance_squared = hit.t * hit.t * squared_length(v);
-        auto cosine = fabs(dot(v, hit.normal) / length(v));
+        auto cosine = fabs(dot(v, normal) / length(v));
 
         return distance_squared / (cosine * area);
     }
 
-    vec3 random(const point3 &origin) const override
+    vec3 random(const point3 &origin, const vec2d &s) const override
     {
-        auto p = Q + (random_double() * u) + (random_double() * v);
+        auto p = Q + (s.x * u) + (s.y * v);
         return p - origin;
     }
 
@@ -6,12 +6,22 @@ class ray
 {
 public:
     ray() {}
-    ray(const point3 &origin, const vec3 &direction, double time = 0.0) : orig(origin), dir(direction), tm(time) {}
+    ray(const point3 &origin, const vec3 &direction, double time = 0.0) : orig(origin), dir(direction), tm(time)
+    {
+        // Cached once per ray for the slab tests of every box it visits
+        inv_dir = vec3(1.0 / dir.x, 1.0 / dir.y, 1.0 / dir.z);
+        dir_sign[0] = inv_dir.x < 0;
+        dir_sign[1] = inv_dir.y < 0;
+        dir_sign[2] = inv_dir.z < 0;
+    }
 
-    point3 origin() const { return orig; }
-    vec3 direction() const { return dir; }
+    const point3 &origin() const { return orig; }
+    const vec3 &direction() const { return dir; }
     double time() const { return tm; }
 
+    const vec3 &inv_direction() const { return inv_dir; }
+    int sign(int axis) const { return dir_sign[axis]; } // 1 if the direction is negative along axis
+
     point3 at(double t) const
     {
         return orig + t * dir;
@@ -21,4 +31,6 @@ private:
     point3 orig;
     vec3 dir; // Be aware that direction may not been normalized
     double tm;
+    vec3 inv_dir;
+    int dir_sign[3];
 };
\ No newline at end of file
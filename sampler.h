@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+
+#include "rtweekend.h"
+
+enum class sampler_type
+{
+    independent,
+    sobol
+};
+
+// Supplies the sample values of one pixel sample, one dimension per call
+// start_pixel_sample() rewinds the dimensions, the same (pixel, sample, dimension) always gives the same value
+class sampler
+{
+public:
+    virtual ~sampler() = default;
+
+    virtual void start_pixel_sample(uint64_t pixel_index, uint32_t sample_index) = 0;
+
+    // Values in [0, 1)
+    virtual double get_1d() = 0;
+    virtual vec2d get_2d() = 0;
+};
+
+// Plain uniform randoms from the thread's generator, which the camera seeds per pixel sample
+class independent_sampler : public sampler
+{
+public:
+    void start_pixel_sample(uint64_t pixel_index, uint32_t sample_index) override {}
+
+    double get_1d() override { return random_double(); }
+    vec2d get_2d() override { return vec2d(random_double(), random_double()); }
+};
+
+// Owen-scrambled Sobol points, padded dimension by dimension as in Burley 2020 (Practical Hash-based Owen Scrambling)
+// Every call draws the first one or two Sobol dimensions with its own index shuffle and scramble seeds,
+// so consecutive dimensions stay decorrelated while each of them is stratified over the samples of the pixel
+class sobol_sampler : public sampler
+{
+public:
+    explicit sobol_sampler(uint32_t _seed = 0) : seed(_seed) {}
+
+    void start_pixel_sample(uint64_t pixel_index, uint32_t sample_index) override
+    {
+        pixel_seed = static_cast<uint32_t>(Math::mix_bits(pixel_index ^ (uint64_t(seed) << 32)));
+        index = sample_index;
+        dimension = 0;
+    }
+
+    double get_1d() override
+    {
+        uint32_t dimension_seed = hash(pixel_seed + dimension++ * 0x9e3779b9u);
+        uint32_t shuffled = nested_uniform_scramble(index, dimension_seed);
+
+        return to_unit(scramble_reversed(sobol_0_reversed(shuffled), hash(dimension_seed ^ 0xa511e9b3u)));
+    }
+
+    vec2d get_2d() override
+    {
+        uint32_t dimension_seed = hash(pixel_seed + dimension++ * 0x9e3779b9u);
+        uint32_t shuffled = nested_uniform_scramble(index, dimension_seed);
+
+        return vec2d(to_unit(scramble_reversed(sobol_0_reversed(shuffled), hash(dimension_seed ^ 0xa511e9b3u))),
+                     to_unit(scramble_reversed(sobol_1_reversed(shuffled), hash(dimension_seed ^ 0x63d83595u))));
+    }
+
+private:
+    uint32_t seed;
+    uint32_t pixel_seed = 0;
+    uint32_t index = 0;
+    uint32_t dimension = 0;
+
+    // lowbias32 (Wellons), cheap enough to run a few times per dimension
+    static uint32_t hash(uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static double to_unit(uint32_t bits) { return bits * 0x1p-32; }
+
+    static uint32_t reverse_bits(uint32_t x)
+    {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+        return x;
+    }
+
+    static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+    {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    // Owen scrambling of all 32 bits, also used to shuffle the sample index
+    static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+    {
+        return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+    }
+
+    // The Sobol points below come bit reversed, which is the order Owen scrambling permutes in,
+    // so scrambling them only has to flip the bits back once at the end
+    static uint32_t scramble_reversed(uint32_t reversed_point, uint32_t seed)
+    {
+        return reverse_bits(laine_karras_permutation(reversed_point, seed));
+    }
+
+    // Sobol dimension 0 is the van der Corput sequence, the reversed point is the index itself
+    static uint32_t sobol_0_reversed(uint32_t i) { return i; }
+
+    // Sobol dimension 1 (polynomial x + 1) has the Pascal matrix mod 2 as generator, by Lucas' theorem
+    // bit r of the reversed point is the parity of the index bits k that contain r as a bit subset
+    static uint32_t sobol_1_reversed(uint32_t i)
+    {
+        i ^= (i >> 1) & 0x55555555u;
+        i ^= (i >> 2) & 0x33333333u;
+        i ^= (i >> 4) & 0x0f0f0f0fu;
+        i ^= (i >> 8) & 0x00ff00ffu;
+        i ^= (i >> 16) & 0x0000ffffu;
+        return i;
+    }
+};
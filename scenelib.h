@@ -18,7 +18,9 @@ void cornell_box(hittable_list &world, hittable_list &lights)
 
     world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
     world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
-    world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+    // The light is shared with the lights list so shadow rays can read its emission
+    auto ceiling_light = make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light);
+    world.add(ceiling_light);
     world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
     world.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
     world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
@@ -33,8 +35,7 @@ void cornell_box(hittable_list &world, hittable_list &lights)
     box2 = make_shared<translate>(box2, vec3(130, 0, 65));
     world.add(box2);
 
-    auto m = shared_ptr<material>();
-    lights.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), m));
+    lights.add(ceiling_light);
 }
 
 // void cornell_box(hittable_list &world, hittable_list &lights)
@@ -47,7 +48,8 @@ void cornell_box(hittable_list &world, hittable_list &lights)
 
 //     world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
 //     world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
-//     world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+//     auto ceiling_light = make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light);
+//     world.add(ceiling_light);
 //     world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
 //     world.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
 //     world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
@@ -62,6 +64,5 @@ void cornell_box(hittable_list &world, hittable_list &lights)
 //     box2 = make_shared<translate>(box2, vec3(130, 0, 65));
 //     world.add(box2);
 
-//     auto m = shared_ptr<material>();
-//     lights.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), m));
+//     lights.add(ceiling_light);
 // }
\ No newline at end of file
@@ -27,37 +27,42 @@ public:
     // According to ray info load the hit_info if hit
     bool hit(const ray &r, interval ray_t, hit_info &hit) const override
     {
-        point3 center = is_moving ? sphere::center(r.time()) : center0;
-        vec3 oc = r.origin() - center;
-        auto a = squared_length(r.direction());
-        auto half_b = dot(r.direction(), oc);
-        auto c = squared_length(oc) - radius * radius;
-
-        auto discriminant = half_b * half_b - a * c;
-        if (discriminant < 0)
+        if (!intersect(r, ray_t, hit))
             return false;
 
-        auto sqrtd = sqrt(discriminant);
+        surface_interaction(r, hit);
+        return true;
+    }
 
-        // Nearest root within ray_t(t_min -> t_max)
-        auto root = (-half_b - sqrtd) / a;
-        if (!ray_t.surrounds(root))
-        {
-            root = (-half_b + sqrtd) / a;
-            if (!ray_t.surrounds(root))
-                return false;
-        }
+    // Only the nearest root, the normal and the (transcendental) uv wait for surface_interaction
+    bool intersect(const ray &r, interval ray_t, hit_info &hit) const override
+    {
+        double root;
+        if (!nearest_root(r, ray_t, root))
+            return false;
 
-        // Hit confirm, fill the hit_info
+        // Hit confirm, the rest of hit_info is filled once this turns out to be the closest hit
         hit.hittable_index = index;
         hit.t = root;
+        hit.object = this;
+
+        return true;
+    }
+
+    void surface_interaction(const ray &r, hit_info &hit) const override
+    {
+        point3 center = is_moving ? sphere::center(r.time()) : center0;
         hit.hit_point = r.at(hit.t);
         vec3 outward_normal = (hit.hit_point - center) / radius;
         hit.set_face_normal(r, outward_normal);
         get_uv(outward_normal, hit.u, hit.v);
-        hit.mat = mat;
+        hit.mat = mat.get();
+    }
 
-        return true;
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        double root;
+        return nearest_root(r, ray_t, root);
     }
 
     aabb bounding_box() const override
@@ -68,8 +73,7 @@ public:
     double pdf_value(const point3 &origin, const vec3 &v) const override
     // the method only works for stationary spheres
     {
-        hit_info hit;
-        if (!this->hit(ray(origin, v), interval(0.001, infinity), hit))
+        if (!occluded(ray(origin, v), interval(0.001, infinity)))
             return 0;
 
         auto cos_theta_max = sqrt(1 - pow(radius, 2) / squared_length(center0 - origin));
@@ -78,13 +82,13 @@ public:
         return 1 / solid_angle;
     }
 
-    vec3 random(const point3 &origin) const override
+    vec3 random(const point3 &origin, const vec2d &u) const override
     {
         vec3 dir = center0 - origin;
         auto dist_squared = squared_length(dir);
         onb coord;
         coord.build_from_w(dir);
-        return coord.local(random2sphere(radius, dist_squared));
+        return coord.local(random2sphere(radius, dist_squared, u));
     }
 
 private:
@@ -100,6 +104,32 @@ private:
         return is_moving ? center0 + time * center_vec : center0;
     }
 
+    // Nearest root within ray_t(t_min -> t_max)
+    bool nearest_root(const ray &r, interval ray_t, double &root) const
+    {
+        point3 center = is_moving ? sphere::center(r.time()) : center0;
+        vec3 oc = r.origin() - center;
+        auto a = squared_length(r.direction());
+        auto half_b = dot(r.direction(), oc);
+        auto c = squared_length(oc) - radius * radius;
+
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = sqrt(discriminant);
+
+        root = (-half_b - sqrtd) / a;
+        if (!ray_t.surrounds(root))
+        {
+            root = (-half_b + sqrtd) / a;
+            if (!ray_t.surrounds(root))
+                return false;
+        }
+
+        return true;
+    }
+
     static void get_uv(const point3 &p, double &u, double &v)
     {
         // p: a given point on the sphere of radius one, centered at the origin
@@ -116,10 +146,10 @@ private:
         v = theta / Math::M_PI;
     }
 
-    static vec3 random2sphere(double radius, double dist_squared)
+    static vec3 random2sphere(double radius, double dist_squared, const vec2d &u)
     {
-        auto r1 = random_double();
-        auto r2 = random_double();
+        auto r1 = u.x;
+        auto r2 = u.y;
         auto z = 1 + r2 * (sqrt(1 - pow(radius, 2) / dist_squared) - 1);
 
         auto phi = 2 * Math::M_PI * r1;